@@ -0,0 +1,56 @@
+#pragma once
+
+#include "paging.hpp"
+#include <libr/error.hpp>
+#include <array>
+#include <cstdint>
+#include <expected>
+
+struct AcpiErrorCategory : rlib::ErrorCategory {};
+inline constexpr auto acpiErrorCategory = AcpiErrorCategory{};
+
+inline constexpr auto InvalidAcpiTable = rlib::Error{-1, &acpiErrorCategory};
+inline constexpr auto MadtNotFound     = rlib::Error{-2, &acpiErrorCategory};
+
+struct IoApicInfo {
+    std::uint8_t  id;
+    std::uint32_t physicalAddress;
+    // First global system interrupt of the IO-APIC.
+    std::uint32_t gsiBase;
+};
+
+// ISA interrupt which is wired to another global system interrupt, or with another polarity or trigger mode.
+struct InterruptOverride {
+    struct Flags {
+        using Type = std::uint16_t;
+
+        static constexpr auto ActiveLow      = Type(3);
+        static constexpr auto PolarityMask   = Type(3);
+        static constexpr auto LevelTriggered = Type(3) << 2;
+        static constexpr auto TriggerMask    = Type(3) << 2;
+    };
+
+    std::uint8_t  irq;
+    std::uint32_t gsi;
+    Flags::Type   flags;
+};
+
+// The interrupt controllers described by the Multiple APIC Description Table.
+struct Madt {
+    static constexpr auto MaxIoApics   = std::size_t(8);
+    static constexpr auto MaxOverrides = std::size_t(16);
+
+    // Global system interrupt and flags of an ISA interrupt, after the overrides.
+    InterruptOverride route(std::uint8_t irq) const;
+
+    std::uint64_t localApicAddress;
+    // Whether the system also has the 8259 PICs, which must be masked before the APICs are used.
+    bool                                        legacyPics;
+    std::array<IoApicInfo, MaxIoApics>          ioApics;
+    std::size_t                                 numberOfIoApics;
+    std::array<InterruptOverride, MaxOverrides> overrides;
+    std::size_t                                 numberOfOverrides;
+};
+
+// Finds the MADT through the RSDP, RSDT or XSDT at physicalAddress. Tables with a bad checksum are skipped.
+std::expected<Madt, rlib::Error> parseMadt(IdentityMapping identityMapping, std::uintptr_t physicalAddress);
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "acpi.hpp"
+#include "paging.hpp"
+#include <libr/error.hpp>
+#include <array>
+#include <cstdint>
+#include <expected>
+#include <optional>
+
+struct ApicErrorCategory : rlib::ErrorCategory {};
+inline constexpr auto apicErrorCategory = ApicErrorCategory{};
+
+inline constexpr auto UnroutableInterrupt = rlib::Error{-1, &apicErrorCategory};
+
+/**
+ * The local APIC of the calling processor.
+ *
+ * Registers are accessed through MSRs in x2APIC mode, which processors use when they support it, and through a page
+ * of memory mapped registers in xAPIC mode otherwise. The page is at the same address on every processor. Until
+ * initialize is called, interrupts are delivered by the 8259 PICs and the local APICs stay untouched.
+ *
+ * The timer fires once per deadline. It compares the deadline with the time stamp counter where the processor
+ * supports it, and otherwise counts down at a rate measured against the PIT.
+ */
+class LocalApic {
+public:
+    static constexpr auto SpuriousVector = std::uint8_t(0xff);
+
+    // Maps the registers at physicalAddress, masks the PICs and enables the local APIC of the calling processor. The
+    // timers of the local APICs raise timerVector.
+    static std::optional<rlib::Error>
+    initialize(AddressSpace& kernelAddressSpace, std::uint64_t physicalAddress, std::uint8_t timerVector);
+
+    // Whether interrupts are delivered through the APICs rather than the PICs.
+    static bool isActive();
+
+    // Enables the local APIC of the calling processor, after initialize was called on another one.
+    static void enable();
+
+    static std::uint32_t id();
+
+    static void endOfInterrupt();
+
+    // Sends a fixed interrupt with vector to the processor whose local APIC has apicId.
+    static void sendIpi(std::uint32_t apicId, std::uint8_t vector);
+
+    // Raises the timer interrupt of the calling processor once the time stamp counter reaches deadline. Replaces the
+    // deadline set before, if any.
+    static void setDeadline(std::uint64_t deadline);
+
+    static void clearDeadline();
+
+private:
+    // Offsets in the xAPIC register page. The x2APIC MSR of a register is X2ApicMsrBase + offset / 16.
+    struct RegisterOffset {
+        using Type = std::uint32_t;
+
+        static constexpr auto Id                = Type(0x20);
+        static constexpr auto EndOfInterrupt    = Type(0xb0);
+        static constexpr auto SpuriousInterrupt = Type(0xf0);
+        static constexpr auto InterruptCommand  = Type(0x300);
+        static constexpr auto InterruptCommand2 = Type(0x310);
+        static constexpr auto LvtTimer          = Type(0x320);
+        static constexpr auto TimerInitialCount = Type(0x380);
+        static constexpr auto TimerCurrentCount = Type(0x390);
+        static constexpr auto TimerDivide       = Type(0x3e0);
+    };
+
+    static std::uint32_t read(RegisterOffset::Type offset);
+
+    static void write(RegisterOffset::Type offset, std::uint32_t value);
+
+    static bool           active;
+    static bool           x2Apic;
+    static VirtualAddress registers;
+    static bool           tscDeadline;
+    static std::uint8_t   timerVector;
+    // Counts per second of the timer in one-shot mode.
+    static std::uint64_t timerFrequency;
+};
+
+// An IO-APIC, which delivers the global system interrupts starting at its base to local APICs. Registers are selected
+// before they are accessed, so an IO-APIC must not be programmed by two processors at once.
+class IoApic {
+public:
+    IoApic() = default;
+
+    IoApic(VirtualAddress registers, std::uint32_t gsiBase);
+
+    bool handles(std::uint32_t gsi) const;
+
+    // Delivers gsi as vector to the local APIC with apicId, which must fit in 8 bits.
+    void route(std::uint32_t gsi, std::uint8_t vector, std::uint32_t apicId, InterruptOverride::Flags::Type flags);
+
+    void mask(std::uint32_t gsi);
+
+    void maskAll();
+
+private:
+    struct RegisterIndex {
+        using Type = std::uint32_t;
+
+        static constexpr auto Version         = Type(0x01);
+        static constexpr auto RedirectionBase = Type(0x10);
+    };
+
+    std::uint32_t read(RegisterIndex::Type index) const;
+
+    void write(RegisterIndex::Type index, std::uint32_t value);
+
+    VirtualAddress registers = VirtualAddress(std::uintptr_t(0));
+    std::uint32_t  gsiBase   = 0;
+    std::uint32_t  size      = 0;
+};
+
+/**
+ * Routes the ISA interrupts through the IO-APICs of the MADT.
+ *
+ * An ISA interrupt may be wired to another global system interrupt, and with another polarity or trigger mode, as
+ * the interrupt source overrides of the MADT tell. Every interrupt arrives at the vector the PICs would have used.
+ */
+class InterruptRouter {
+public:
+    static std::expected<InterruptRouter, rlib::Error> make(const Madt& madt, AddressSpace& kernelAddressSpace);
+
+    // Delivers irq at vector to the processor whose local APIC has apicId.
+    std::optional<rlib::Error> route(std::uint8_t irq, std::uint8_t vector, std::uint32_t apicId);
+
+    void mask(std::uint8_t irq);
+
+private:
+    InterruptRouter(const Madt& madt, std::array<IoApic, Madt::MaxIoApics> ioApics);
+
+    IoApic* find(std::uint32_t gsi);
+
+    Madt                                 madt;
+    std::array<IoApic, Madt::MaxIoApics> ioApics;
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <atomic>
 #include "paging.hpp"
 #include <libr/allocator.hpp>
 #include <libr/ringbuffer.hpp>
@@ -12,6 +13,9 @@
 namespace Register {
 
     struct CR3 {
+        // Keeps the TLB entries of the loaded PCID when written.
+        static constexpr auto NoFlush = std::uint64_t(1) << 63;
+
         static std::uint64_t read();
 
         static void write(std::uint64_t rootPageTablePhysicalAddress);
@@ -19,18 +23,43 @@ namespace Register {
         static void flushTLBS();
     };
 
-} // namespace Register
+    struct CR2 {
+        static std::uint64_t read();
+    };
+
+    struct CR4 {
+        static constexpr auto PGE   = std::uint64_t(1) << 7;
+        static constexpr auto PCIDE = std::uint64_t(1) << 17;
+
+        static std::uint64_t read();
+
+        static void write(std::uint64_t value);
+
+        // Flushes all TLB entries, including global ones and those of other PCIDs.
+        static void flushTLBS();
+    };
+
+    struct TSC {
+        static std::uint64_t read();
+    };
+
+    struct MSR {
+        static constexpr auto ApicBase    = std::uint32_t(0x1b);
+        static constexpr auto TscDeadline = std::uint32_t(0x6e0);
 
-struct CpuErrorCategory : rlib::ErrorCategory {};
-inline constexpr auto cpuErrorCategory = CpuErrorCategory{};
+        static std::uint64_t read(std::uint32_t msr);
 
-inline constexpr auto AlreadyCreated = rlib::Error{-1, &cpuErrorCategory};
+        static void write(std::uint32_t msr, std::uint64_t value);
+    };
 
+} // namespace Register
 
 struct Context {
     struct Flags {
         using Type                       = std::uint16_t;
         static constexpr auto KernelMode = Type(1) << 0;
+        // All registers were saved on preemption, rather than only those a system call preserves.
+        static constexpr auto FullState = Type(1) << 1;
     };
 
     static Context make(
@@ -50,6 +79,15 @@ struct Context {
     std::uint64_t r13;
     std::uint64_t r14;
     std::uint64_t r15;
+    std::uint64_t rax;
+    std::uint64_t rcx;
+    std::uint64_t rdx;
+    std::uint64_t rsi;
+    std::uint64_t rdi;
+    std::uint64_t r8;
+    std::uint64_t r9;
+    std::uint64_t r10;
+    std::uint64_t r11;
     Flags::Type   flags;
 } __attribute__((packed));
 
@@ -77,32 +115,95 @@ struct __attribute__((packed)) TaskStateSegment {
 
 struct InterruptFrame;
 
+class Cpu;
+
+// Per processor data, addressed through the GS base.
 struct Core {
     std::uintptr_t kernelStack;
     Context*       activeContext;
+    Cpu*           cpu;
 } __attribute__((packed));
 
 struct CpuObserver {
     virtual void onInterrupt(std::uint8_t Irq) = 0;
 
     virtual Context& onSyscall(Context& sender) = 0;
+
+    // Return false if the fault cannot be resolved.
+    virtual bool onPageFault(Context& active, VirtualAddress address, PageFaultFlags::Type flags) = 0;
+
+    // Called on every timer interrupt, also when another processor sends one. Returns the context to continue with,
+    // which must be active unless preemptible.
+    virtual Context& onTimer(Context& active, bool preemptible) = 0;
 };
 
 
 extern "C" Context* systemCallHandler();
 
+extern "C" Context* timerInterruptHandler(bool userMode);
+
+/**
+ * A processor, with its own descriptor tables, interrupt and system call stacks.
+ *
+ * Every processor creates its Cpu itself, as the tables and the GS base are loaded into the processor which runs
+ * make. The first Cpu belongs to the bootstrap processor, which also owns the legacy interrupt controller and timer.
+ */
 class Cpu {
 public:
-    Cpu(void* interruptStack, void* syscallStack, Context& initialContext);
+    static constexpr auto TimerFrequency           = std::uint32_t(100); // Hz
+    static constexpr auto IdtHardwareInterruptBase = std::uint8_t(32);
+    static constexpr auto TimerIrq                 = std::uint8_t(0);
+
+    Cpu(std::uint32_t index, void* interruptStack, void* pageFaultStack, void* syscallStack, Context& initialContext);
 
     static std::expected<Cpu*, rlib::Error> make(rlib::Allocator& allocator, Context& intialContext);
 
+    // The Cpu of the calling processor.
+    static Cpu& current();
+
+    // APIC ID of the calling processor, as reported by CPUID. The full x2APIC ID where the processor has one, which may
+    // exceed 8 bits.
+    static std::uint32_t localApicId();
+
+    // Loads the root page table and calls entry with argument on a new stack, which is mapped by that table. The old
+    // stack need not be mapped.
+    [[noreturn]] static void
+    enterAddressSpace(std::uint64_t rootPageTablePhysicalAddress, void* stackTop, void (*entry)(void*), void* argument);
+
     static void setRootPageTable(std::uint64_t rootPageTablePhysicalAddress);
 
-    static Cpu& getInstance();
+    // Invalidates the TLB entries of the page covering address, for the current PCID and global ones.
+    static void invalidatePage(std::uintptr_t address);
+
+    // Enables global pages, and drops any global TLB entries left behind by the boot loader.
+    static void enableGlobalPages();
+
+    // Enables process-context identifiers when the processor supports them.
+    // Must be called while the loaded CR3 refers to PCID 0.
+    static bool enablePcid();
 
     static void halt();
 
+    static void enableInterrupts();
+
+    static void disableInterrupts();
+
+    // Enables interrupts and halts until the next one. An interrupt which is pending while interrupts are disabled
+    // ends the halt, rather than slip in before it.
+    static void enableInterruptsAndHalt();
+
+    // Time stamp counter cycles per second, measured against the PIT by the bootstrap processor.
+    static std::uint64_t tscFrequency();
+
+    // Hint to the processor that it spins on a lock.
+    static void pause();
+
+    // Zero-based index of the processor, in the order in which the Cpus were made.
+    std::uint32_t index() const;
+
+    // ID of the local APIC of the processor, by which interrupts are routed to it.
+    std::uint32_t apicId() const;
+
     void registerObserver(CpuObserver& observer);
 
     void scheduleContext(Context& context);
@@ -111,20 +212,29 @@ private:
     template<std::uint8_t Irq>
     friend __attribute__((interrupt)) void hardwareInterruptHandler(InterruptFrame* frame);
 
+    friend __attribute__((interrupt)) void pageFaultHandler(InterruptFrame* frame, std::uint64_t errorCode);
+
+    friend __attribute__((interrupt)) void spuriousInterruptHandler(InterruptFrame* frame);
+
     friend Context* systemCallHandler();
 
-    static rlib::OwningPointer<Cpu> instance;
+    friend Context* timerInterruptHandler(bool userMode);
 
-    void setupGdt(void* interruptStack);
+    static std::atomic<std::uint32_t> count;
+    static std::uint64_t              tscCyclesPerSecond;
+
+    void setupGdt(void* interruptStack, void* pageFaultStack);
     void setupIdt();
     void setupSyscall(void* syscallStack, Context& initialContext);
 
-    static constexpr auto KernelSegmentIndex       = std::uint16_t(1);
-    static constexpr auto UserSegmentIndex         = std::uint16_t(3);
-    static constexpr auto IstIndex                 = std::uint8_t(1);
-    static constexpr auto IdtHardwareInterruptBase = std::uint8_t(32);
-    static constexpr auto InterruptStackSize       = 1_KiB;
-    static constexpr auto SyscallStackSize         = 1_KiB;
+    static constexpr auto KernelSegmentIndex = std::uint16_t(1);
+    static constexpr auto UserSegmentIndex   = std::uint16_t(3);
+    static constexpr auto IstIndex           = std::uint8_t(1);
+    static constexpr auto PageFaultIstIndex  = std::uint8_t(2);
+    static constexpr auto PitFrequency       = std::uint32_t(1193182);
+    static constexpr auto InterruptStackSize = 1_KiB;
+    static constexpr auto PageFaultStackSize = 4_KiB;
+    static constexpr auto SyscallStackSize   = 1_KiB;
 
     uint64_t      gdt[7];
     IdtDescriptor idt[256];
@@ -133,7 +243,9 @@ private:
     // during a task switch (the first 104 bytes)."
     alignas(std::bit_ceil(sizeof(TaskStateSegment))) TaskStateSegment tss;
     std::atomic<std::size_t> spuriousIRQCount;
-    Core                     core; // A single core for now
+    Core                     core;
+    std::uint32_t            _index;
+    std::uint32_t            _apicId;
 
     CpuObserver* observer;
 };
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include "paging.hpp"
+#include <libr/allocator.hpp>
+#include <libr/error.hpp>
+#include <expected>
+#include <optional>
+#include <array>
+
+/**
+ * Kernel heap in a window of the kernel address space, backed by memory only where it is in use.
+ *
+ * The window is divided into chunks of 2 MiB, which are committed with a huge page when allocation reaches them.
+ * Allocations are bumped from the current chunk, or span whole chunks when they are larger. Every chunk counts the
+ * allocations which touch it; a chunk which is not current is decommitted as soon as its count drops to zero, and can
+ * be committed again later.
+ */
+class KernelHeap : public rlib::Allocator {
+public:
+    static constexpr auto ChunkSize = std::size_t(2_MiB);
+    static constexpr auto MaxChunks = std::size_t(128);
+
+    static std::expected<KernelHeap, rlib::Error>
+    make(AddressSpace& addressSpace, std::size_t size, PageFlags::Type flags);
+
+private:
+    struct Chunk {
+        std::uint32_t allocations = 0;
+        bool          committed   = false;
+    };
+
+    explicit KernelHeap(Region& window);
+
+    // First of count consecutive chunks which are not committed.
+    std::optional<std::size_t> findFreeChunks(std::size_t count) const;
+
+    void decommit(std::size_t chunk);
+
+    std::size_t chunkOf(void* p) const;
+
+    virtual void* do_allocate(std::size_t bytes, std::size_t alignment) final;
+
+    virtual void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) final;
+
+    virtual bool do_owns(void* p) const final;
+
+    Region*                      window;
+    std::size_t                  numberOfChunks;
+    std::array<Chunk, MaxChunks> chunks;
+    std::optional<std::size_t>   current;
+    // Offset of the first free byte in the current chunk.
+    std::size_t                  offset;
+};
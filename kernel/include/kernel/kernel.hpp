@@ -6,8 +6,14 @@
 #include <libr/intrusive/list.hpp>
 #include <libr/elf.hpp>
 #include <libr/memory_resource.hpp>
+#include <libr/spinlock.hpp>
+#include <array>
+#include <atomic>
+#include <span>
 #include "cpu.hpp"
+#include "apic.hpp"
 #include "ipc.hpp"
+#include "panic.hpp"
 
 struct KernelErrorCategory : rlib::ErrorCategory {};
 inline constexpr auto kernelErrorCategory = KernelErrorCategory{};
@@ -19,6 +25,8 @@ inline constexpr auto CannotMapProcessMemory   = rlib::Error{-4, &kernelErrorCat
 inline constexpr auto CannotCopySegment        = rlib::Error{-5, &kernelErrorCategory};
 inline constexpr auto UnexpectedMemoryLayout   = rlib::Error{-6, &kernelErrorCategory};
 
+struct Processor;
+
 struct Thread {
     static constexpr auto MessageBufferSize = std::size_t(256);
 
@@ -46,12 +54,132 @@ struct Thread {
     Region*                                              ipcBuffer = nullptr;
     Region*                                              ipcBufferUserMapping = nullptr;
     rlib::intrusive::ListNode<Thread>                    listNode;
+    rlib::intrusive::ListNode<Thread>                    runQueueNode;
+    // The processor in whose run queue the thread is, or on which it runs or ran last.
+    Processor*                                           processor = nullptr;
+    // Time stamp at which the thread was last made ready.
+    std::uint64_t                                        readySince = 0;
+    // Pinned threads stay on their processor.
+    bool                                                 pinned = false;
+};
+
+// Statistics of a run queue, in time stamp counter cycles where they measure time.
+struct SchedulerStats {
+    // Threads taken from the run queue to run, by its own processor or by others.
+    std::uint64_t dispatched = 0;
+    // Threads taken by other processors.
+    std::uint64_t stolen = 0;
+    // Total and longest time which the dispatched threads were ready before they were taken.
+    std::uint64_t wakeupLatency    = 0;
+    std::uint64_t maxWakeupLatency = 0;
+    // Total time which the processor spent without a thread to run.
+    std::uint64_t idleTime = 0;
+    // Times the processor woke up from a halt.
+    std::uint64_t wakeups = 0;
+};
+
+/**
+ * Round robin run queue of a single processor.
+ *
+ * The running thread is not in the run queue. It runs for a time slice of TimeSlice milliseconds, after which the
+ * thread at the front of the queue is due, and the running thread goes to the back.
+ *
+ * Other processors take threads from the queue when they run out of work of their own. They leave threads alone
+ * which were made ready less than CacheHotCycles ago, as those likely still have their working set in the caches of
+ * this processor. Every queue has a lock of its own, so that processors only contend when they steal.
+ */
+class Scheduler {
+public:
+    static constexpr auto TimeSlice      = std::uint64_t(20);      // Milliseconds
+    static constexpr auto CacheHotCycles = std::uint64_t(500'000); // About a quarter of a millisecond
+
+    static std::expected<Scheduler, rlib::Error> make(rlib::Allocator& allocator);
+
+    // Only a scheduler which is not in use yet can be moved.
+    Scheduler(Scheduler&& other);
+
+    // Makes thread ready to run after the threads which are ready already.
+    void enqueue(Thread& thread);
+
+    // Takes thread out of the run queue, if it is in there.
+    void remove(Thread& thread);
+
+    // Takes the thread which has been ready the longest, if any.
+    Thread* dequeue();
+
+    // Takes the thread which has been ready the longest for another processor, skipping pinned and cache hot threads.
+    // Gives up rather than wait for the lock.
+    Thread* steal();
+
+    // Takes a thread like steal, to move it to another run queue rather than run it. It does not count as dispatched.
+    Thread* migrate();
+
+    // The number of ready threads. Other processors read it without the lock, as a hint.
+    std::size_t size() const;
+
+    // The number of ready threads which are not pinned, cache hot or not. Read without the lock, as a hint.
+    std::size_t stealableSize() const;
+
+    // Starts a new time slice.
+    void start();
+
+    // Whether the time slice of the running thread is used up.
+    bool expired() const;
+
+    // Time stamp at which the time slice of the running thread ends.
+    std::uint64_t sliceEnd() const;
+
+    // Counts a halt of cycles, in which the processor had nothing to run.
+    void idle(std::uint64_t cycles);
+
+    const SchedulerStats& stats() const;
+
+private:
+    using RunQueue = rlib::intrusive::ListWithNodeMember<Thread, &Thread::runQueueNode>;
+
+    explicit Scheduler(RunQueue runQueue);
+
+    // Unlinks thread, which is in the run queue, and accounts for the time it was ready. Expects lock to be held.
+    void take(Thread& thread);
+
+    // Unlinks thread, which is in the run queue, without accounting. Expects lock to be held.
+    void unlink(Thread& thread);
+
+    // The thread which has been ready the longest of those which other processors may take. Expects lock to be held.
+    Thread* findStealable();
+
+    rlib::SpinLock           lock;
+    RunQueue                 runQueue;
+    std::atomic<std::size_t> length          = 0;
+    std::atomic<std::size_t> stealableLength = 0;
+    std::uint64_t            _sliceEnd       = 0;
+    SchedulerStats           _stats;
 };
 
 struct HardwareInterrupt {
     std::uint8_t IRQ;
 };
 
+// Kernel state which belongs to a single processor.
+struct Processor {
+    static constexpr auto InterruptBufferSize = std::size_t(256);
+
+    static std::expected<Processor*, rlib::Error> make(rlib::Allocator& allocator, Thread& idleThread);
+
+    Processor(Thread& idleThread, Scheduler scheduler);
+
+    Cpu*                                                           cpu = nullptr;
+    // Runs when no other thread is ready. The bootstrap processor runs the kernel thread instead of an idle thread.
+    Thread*                                                        idleThread;
+    // Interrupts taken by the processor, until the kernel thread handles them.
+    rlib::spscBoundedQueue<HardwareInterrupt, InterruptBufferSize> interrupts;
+    Scheduler                                                      scheduler;
+    // Set while the processor halts for lack of work, so that other processors wake it when there is some.
+    std::atomic<bool>                                              halted        = false;
+    // TlbGather::globalFlushes when the processor last flushed its TLB.
+    std::atomic<std::uint64_t>                                     globalFlushes = 0;
+};
+
 struct MemoryLayout {
     rlib::Iterator<Block>* freeMemoryBlocks;
     std::size_t            totalPhysicalMemory;
@@ -64,48 +192,99 @@ struct MemoryLayout {
     std::size_t            framebufferSize;
     std::uintptr_t         initrdPhysicalAddress;
     std::size_t            initrdSize;
+    // RSDP, RSDT or XSDT of the firmware; zero without ACPI.
+    std::uintptr_t         acpiPhysicalAddress;
+};
+
+// Duration of the boot phases in time stamp counter cycles.
+struct BootTimings {
+    std::uint64_t frameAllocator;
+    std::uint64_t kernelAddressSpace;
 };
 
-class Kernel : public CpuObserver {
+// Statistics of each link of the kernel heap chain.
+struct HeapStatistics {
+    const rlib::AllocatorStats* slabs;
+    const rlib::AllocatorStats* sizeClasses;
+    const rlib::AllocatorStats* bootstrap;
+};
+
+class Kernel : public CpuObserver, public PanicObserver, public TlbShootdown {
 public:
     using ThreadList = rlib::intrusive::ListWithNodeMember<Thread, &Thread::listNode>;
 
-    static constexpr auto IntialHeapSize = std::size_t(4_KiB);
+    static constexpr auto IntialHeapSize = std::size_t(16_KiB);
 
-    static std::expected<Kernel, rlib::Error>
-    make(MemoryLayout memoryLayout, std::byte* initialHeapStorage, TableView rootPageTable);
+    static constexpr auto MaxProcessors = std::size_t(64);
+
+    static std::expected<Kernel, rlib::Error> make(
+        MemoryLayout memoryLayout,
+        std::size_t  numberOfProcessors,
+        std::byte*   initialHeapStorage,
+        TableView    rootPageTable
+    );
 
     Kernel(
         Thread*                               kernelThread,
         PageMapper*                           pageMapper,
-        Cpu&                                  cpu,
+        Processor&                            bootstrapProcessor,
+        std::span<std::byte>                  processorStacks,
+        std::optional<InterruptRouter>        interruptRouter,
         rlib::Allocator*                      allocator,
         rlib::InputStream<rlib::MemorySource> initrd,
         ThreadList                            threads,
-        std::uint32_t*                        framebuffer
+        std::uint32_t*                        framebuffer,
+        BootTimings                           bootTimings,
+        HeapStatistics                        heapStatistics
     );
 
     Kernel(const Kernel&) = delete;
 
     Kernel& operator=(const Kernel&) = delete;
 
+    // Runs the kernel thread on the bootstrap processor.
     void run();
 
+    /**
+     * Brings up the calling application processor, which still runs on its boot stack in the page tables of the boot
+     * loader. The processor moves to a stack of its own in the kernel address space, and idles there.
+     */
+    [[noreturn]] void startProcessor();
+
+    const BootTimings& bootTimings() const;
+
+    const HeapStatistics& heapStatistics() const;
+
     std::expected<Thread*, rlib::Error>
     createThread(rlib::OwningPointer<AddressSpace> addressSpace, std::uint64_t entryPoint, std::uintptr_t stackTop);
 
     void scheduleThread(Thread& thread);
 
+    // Delivers irq to processor. Fails when interrupts go through the PICs, which only deliver to the bootstrap
+    // processor.
+    std::optional<rlib::Error> routeInterrupt(std::uint8_t irq, Processor& processor);
+
     void killThread(rlib::Allocator& allocator, Thread& thread);
 
     virtual void onInterrupt(std::uint8_t Irq) final;
 
     virtual Context& onSyscall(Context& sender) final;
 
+    virtual bool onPageFault(Context& active, VirtualAddress address, PageFaultFlags::Type flags) final;
+
+    virtual Context& onTimer(Context& active, bool preemptible) final;
+
+    virtual void onPanic(PanicWriter& writer) final;
+
+    // Interrupts the processors which missed the flush, and waits until they have caught up.
+    virtual void shootdown(std::uint64_t globalFlushes) final;
+
 private:
-    static constexpr auto KernelStackSize     = std::size_t(64_KiB);
-    static constexpr auto InterruptBufferSize = std::size_t(256);
-    static constexpr auto KernelHeapSize      = std::size_t(1_MiB);
+    static constexpr auto KernelStackSize    = std::size_t(64_KiB);
+    static constexpr auto KernelHeapSize     = std::size_t(256_MiB);
+    static constexpr auto ProcessorStackSize = std::size_t(16_KiB);
+    static constexpr auto RebalanceInterval  = std::uint64_t(100); // Milliseconds
+    static constexpr auto KeyboardIrq        = std::uint8_t(1);
 
     static std::optional<rlib::Error> setupKernelAddressSpace(
         AddressSpace& addressSpace, TableView rootPageTable, MemoryLayout memoryLayout, PageMapper& pageMapper
@@ -113,14 +292,76 @@ private:
 
     Thread* kernelThread() const;
 
+    // Continues startProcessor in the kernel address space.
+    [[noreturn]] void runProcessor();
+
+    // Makes the kernel state of a processor known. Expects lock to be held.
+    void addProcessor(Processor& processor);
+
+    // Prepares thread to take over processor, and returns the context to load.
+    Context& activate(Processor& processor, Thread& thread);
+
+    Processor& currentProcessor() const;
+
+    // Flushes the TLB of processor, which must be the calling one, if it missed flushes of the kernel half.
+    void catchUp(Processor& processor);
+
+    // Takes lock on behalf of processor, which must be the calling one. A holder may wait for the processor to catch
+    // up, see shootdown, so it does while it waits.
+    rlib::LockGuard<rlib::SpinLock> lockKernel(Processor& processor);
+
+    // Puts thread in the run queue of processor, and wakes the processors which might run it.
+    void makeReady(Processor& processor, Thread& thread);
+
+    // Sends processor a timer interrupt, to wake it from a halt or have it rearm its timer.
+    void wake(Processor& processor);
+
+    /**
+     * Halts the calling processor until the next event which concerns it. Without local APICs, application
+     * processors cannot be woken and poll instead.
+     *
+     * The timer is armed only when threads wait on other processors, to steal one once it is no longer cache hot. An
+     * idle processor otherwise sleeps until another one makes a thread ready for it.
+     */
+    void waitForWork(Processor& processor);
+
+    // Whether messages or interrupts wait for the kernel thread.
+    bool kernelWorkPending() const;
+
+    // Arms the timer of the calling processor for the end of the time slice of thread, if another thread waits for
+    // the processor. Kernel mode threads give up the processor themselves, and need no deadline.
+    void armTimer(Processor& processor, const Thread& thread);
+
+    // Takes the next thread to run on processor from its own run queue, or else from the busiest other processor.
+    // Returns null if no thread is ready.
+    Thread* pickNext(Processor& processor);
+
+    // Moves ready threads from the busiest to the least busy processor, until their run queues differ by at most one
+    // thread or only cache hot threads are left.
+    void rebalance();
+
     // TODO: Implement type erased InputStream
     std::expected<Thread*, rlib::Error> loadProcess(rlib::InputStream<rlib::MemorySource>& process);
 
-    PageMapper*                                                    pageMapper;
-    Cpu*                                                           cpu;
-    rlib::Allocator*                                               allocator;
-    rlib::spscBoundedQueue<HardwareInterrupt, InterruptBufferSize> interrupts;
-    ThreadList                                                     threads;
-    std::uint32_t*                                                 framebuffer;
-    Thread*                                                        service;
+    // Guards the state which the processors share: threads, memory and the processors themselves. Run queues have
+    // locks of their own.
+    // Handlers take it only on entry from user mode, as the kernel might hold it already. Registered processors take
+    // it with lockKernel.
+    rlib::SpinLock                                     lock;
+    PageMapper*                                        pageMapper;
+    Cpu*                                               cpu;
+    PcidAllocator                                      pcids;
+    rlib::Allocator*                                   allocator;
+    std::array<std::atomic<Processor*>, MaxProcessors> processors{};
+    // Stacks of the application processors, claimed by startedProcessors as they start.
+    std::span<std::byte>                               processorStacks;
+    std::atomic<std::size_t>                           startedProcessors = 0;
+    // Absent when interrupts go through the PICs.
+    std::optional<InterruptRouter>                     interruptRouter;
+    std::uint64_t                                      kernelRootTable;
+    ThreadList                                         threads;
+    std::uint32_t*                                     framebuffer;
+    Thread*                                            service;
+    BootTimings                                        timings;
+    HeapStatistics                                     heapStats;
 };
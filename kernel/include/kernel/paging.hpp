@@ -4,11 +4,15 @@
 #include <libr/allocator.hpp>
 #include <libr/error.hpp>
 #include <libr/pointer.hpp>
-#include <libr/intrusive/skiplist.hpp>
+#include <libr/intrusive/list.hpp>
+#include <libr/intrusive/tree.hpp>
 #include <libr/type_erasure.hpp>
 #include <libr/memory_resource.hpp>
 #include <optional>
 #include <expected>
+#include <array>
+#include <atomic>
+#include <ranges>
 
 constexpr std::size_t operator""_KiB(unsigned long long int x)
 {
@@ -51,6 +55,8 @@ inline constexpr auto VirtualRangeInUse   = rlib::Error(-2, &virtualMemoryCatego
 inline constexpr auto AlreadyMapped       = rlib::Error(-3, &virtualMemoryCategory);
 inline constexpr auto NotMapped           = rlib::Error(-4, &virtualMemoryCategory);
 inline constexpr auto OutOfBounds         = rlib::Error(-5, &virtualMemoryCategory);
+inline constexpr auto AccessViolation     = rlib::Error(-6, &virtualMemoryCategory);
+inline constexpr auto SharedFrame         = rlib::Error(-7, &virtualMemoryCategory);
 
 class VirtualAddress {
 public:
@@ -66,6 +72,8 @@ public:
 
     constexpr std::uint16_t indexLevel1() const { return (address >> 12) & 0x1FF; }
 
+    constexpr std::uint16_t index(std::uint8_t level) const { return (address >> (3 + 9 * level)) & 0x1FF; }
+
     template<class T = void>
     constexpr T* ptr() const
     {
@@ -87,6 +95,9 @@ struct IdentityMapping {
     explicit IdentityMapping(std::size_t offset);
 
     VirtualAddress translate(std::size_t physicalAddress) const;
+
+    // Inverse of translate.
+    std::uintptr_t physicalAddress(VirtualAddress virtualAddress) const;
 private:
     std::size_t offset;
 };
@@ -96,10 +107,48 @@ struct FreePage {
     rlib::intrusive::ListNode<FreePage> node;
 };
 
-// Holds a stack of physical memory frames.
-// Uses no memory by storing the stack inside free pages.
+// Bookkeeping for a single physical frame.
+struct FrameDescriptor {
+    // Order plus one when the frame is the first frame of a free block, zero otherwise.
+    std::uint8_t  freeOrder;
+    // Set when the frame belongs to an allocated block which was split. Every frame then counts its own references,
+    // including those of mappings of the whole block.
+    bool          split;
+    // Number of mappings of the block headed by this frame, when it is allocated.
+    std::uint16_t references;
+    // Number of non-empty entries, when the frame holds a page table.
+    std::uint16_t entries;
+};
+
+// A physically contiguous range of frames managed by the PageFrameAllocator.
+// The descriptors of the frames are stored at the start of the range itself.
+//
+// Frames are carved out of the zone on demand: only frames below carvedAddress have ever been handed to the buddy
+// allocator. Descriptors of frames above it are not initialized.
+struct FrameZone {
+    std::uintptr_t   startAddress;
+    std::uintptr_t   carvedAddress;
+    std::uintptr_t   endAddress;
+    FrameDescriptor* descriptors;
+
+    bool isCarved(std::uintptr_t physicalAddress, std::size_t size) const;
+
+    FrameDescriptor& descriptor(std::uintptr_t physicalAddress, std::size_t frameSize) const;
+};
+
+// Buddy allocator for physical memory frames.
+// Free blocks of 2^order frames are kept in one list per order.
+// Uses little memory by storing the lists inside the free blocks.
+//
+// Construction only records the free ranges of the memory map, so that its cost does not depend on the amount of
+// memory. Blocks are carved from those ranges when the free lists run dry. Adjacent ranges are merged; when there are
+// more than MaxZones ranges still, the smallest ones are left unused.
 class PageFrameAllocator {
 public:
+    // With 4 KiB frames, order 9 is a 2 MiB block and order 18 a 1 GiB block.
+    static constexpr auto MaxOrder = std::size_t(18);
+    static constexpr auto MaxZones = std::size_t(32);
+
     static std::expected<PageFrameAllocator, rlib::Error> make(
         rlib::Iterator<Block>& memoryMap,
         IdentityMapping        identityMapping,
@@ -107,19 +156,79 @@ public:
         rlib::Allocator&       allocator
     );
 
-    std::expected<Block, rlib::Error> alloc();
+    /**
+     * Allocate a physically contiguous block of 2^order frames.
+     * 
+     * The block is aligned to its size.
+     * 
+     * @param order Binary logarithm of the number of frames.
+     * @returns The allocated block, or OutOfPhysicalMemory.
+     */
+    std::expected<Block, rlib::Error> alloc(std::size_t order = 0);
+
+    /**
+     * Return a block of 2^order frames, coalescing it with its free buddies.
+     * 
+     * Frames which are not part of any zone, such as memory reserved by the boot loader, are ignored.
+     */
+    void dealloc(std::uintptr_t physicalAddress, std::size_t order = 0);
+
+    // Take an additional reference to an allocated block of 2^order frames. Frames outside of any zone are pinned and
+    // not counted.
+    void acquire(std::uintptr_t physicalAddress, std::size_t order = 0);
+
+    /**
+     * Drop a reference to an allocated block of 2^order frames, returning it when the last reference is dropped.
+     * 
+     * @returns True if the block was returned.
+     */
+    bool release(std::uintptr_t physicalAddress, std::size_t order = 0);
+
+    // Number of references to an allocated block of 2^order frames, or to the most referenced of its frames once it
+    // is split; zero for pinned frames.
+    std::size_t references(std::uintptr_t physicalAddress, std::size_t order = 0);
+
+    // Descriptor of the frame, or null if the frame is not part of any zone.
+    FrameDescriptor* descriptor(std::uintptr_t physicalAddress);
+
+    // Turn an allocated block of 2^order frames into single frame blocks which can be released independently.
+    // Every frame inherits the references of the block. A block which is split already is left alone.
+    void split(std::uintptr_t physicalAddress, std::size_t order);
+
+    // Smallest order of a block which holds at least size bytes.
+    std::size_t order(std::size_t size) const;
+
+    // Bytes of free memory in the memory map which are not managed, as their range did not fit in the zones.
+    std::size_t unusedMemory() const;
 
-    void dealloc(std::uintptr_t physicalAddress);
 private:
     using FreePageList = rlib::intrusive::ListWithNodeMember<FreePage, &FreePage::node>;
+    using FreeLists    = std::array<FreePageList, MaxOrder + 1>;
 
     PageFrameAllocator(
-        FreePageList freePages, rlib::Iterator<Block>& memoryMap, IdentityMapping identityMapping, std::size_t frameSize
+        FreeLists freeLists, rlib::Iterator<Block>& memoryMap, IdentityMapping identityMapping, std::size_t frameSize
     );
 
-    FreePageList    freePages;
-    IdentityMapping identityMapping;
-    std::size_t     frameSize;
+    void addZone(Block block);
+
+    // Move the largest naturally aligned block at the carve address of the next non-exhausted zone to the free lists.
+    bool carve();
+
+    std::optional<std::size_t> firstFreeOrder(std::size_t order) const;
+
+    FrameZone* findZone(std::uintptr_t physicalAddress);
+
+    void pushFree(FrameZone& zone, std::uintptr_t physicalAddress, std::size_t order);
+
+    std::size_t blockSize(std::size_t order) const;
+
+    FreeLists                       freeLists;
+    std::array<FrameZone, MaxZones> zones;
+    std::size_t                     numberOfZones;
+    std::size_t                     carveZone;
+    IdentityMapping                 identityMapping;
+    std::size_t                     frameSize;
+    std::size_t                     _unusedMemory;
 };
 
 struct PageFlags {
@@ -128,10 +237,38 @@ struct PageFlags {
     static constexpr auto Present        = Type(1);
     static constexpr auto Writable       = Type(1) << 1;
     static constexpr auto UserAccessible = Type(1) << 2;
+    static constexpr auto WriteThrough   = Type(1) << 3;
+    static constexpr auto CacheDisable   = Type(1) << 4;
     static constexpr auto HugePage       = Type(1) << 7;
     static constexpr auto Global         = Type(1) << 8;
     static constexpr auto NoExecute      = Type(1) << 63;
-    static constexpr auto All            = Present | Writable | UserAccessible | HugePage | Global | NoExecute;
+    static constexpr auto All =
+        Present | Writable | UserAccessible | WriteThrough | CacheDisable | HugePage | Global | NoExecute;
+};
+
+// Error code pushed by the processor on a page fault.
+struct PageFaultFlags {
+    using Type = std::uint64_t;
+
+    static constexpr auto Present          = Type(1);
+    static constexpr auto Write            = Type(1) << 1;
+    static constexpr auto User             = Type(1) << 2;
+    static constexpr auto InstructionFetch = Type(1) << 4;
+};
+
+struct RegionFlags {
+    using Type = std::uint8_t;
+
+    // Back a page when it is first touched, instead of when the region is allocated.
+    // A read maps the shared zero frame, a write a fresh zeroed frame.
+    static constexpr auto ZeroFillOnDemand = Type(1);
+    // Writable pages may be mapped read-only because their frames are shared, possibly with the zero frame; copy
+    // them on the first write.
+    static constexpr auto CopyOnWrite = Type(1) << 1;
+    // Frames belong to a region of another address space; see AddressSpace::share.
+    static constexpr auto Shared = Type(1) << 2;
+    // Back the 2 MiB aligned parts of a region of 4 KiB pages with 2 MiB pages where possible.
+    static constexpr auto TransparentHugePages = Type(1) << 3;
 };
 
 enum struct PageSize : std::uint32_t {
@@ -185,6 +322,74 @@ struct PageFrame {
     std::uintptr_t physicalAddress;
 };
 
+class PageMapper;
+class TlbGather;
+
+// Walks the page tables of an address space, remembering the tables it resolved on the way down.
+// Consecutive operations on nearby addresses only resolve the levels which differ, so an operation on a range costs
+// one walk per leaf table instead of one walk per page.
+//
+// The cursor does not notice changes made to the page tables behind its back; keep its lifetime short.
+class PageTableCursor {
+public:
+    struct Lookup {
+        // Entry which maps the address, if any.
+        std::optional<TableEntryView> entry;
+        // Size of the page mapped by entry. When the address is not mapped, size of the empty subtree covering it.
+        std::size_t size;
+    };
+
+    PageTableCursor(PageMapper& pageMapper, TableView tableLevel4);
+
+    Lookup find(VirtualAddress virtualAddress);
+
+    // Translate virtualAddress to a physical address.
+    std::optional<std::uintptr_t> read(VirtualAddress virtualAddress);
+
+    /**
+     * Find the entry of the table at the level of pageSize which covers virtualAddress.
+     * 
+     * Create intermediate tables when necessary.
+     * 
+     * @returns The (possibly empty) entry, or AlreadyMapped when a huge page covers the address.
+     */
+    std::expected<TableEntryView, rlib::Error> ensure(VirtualAddress virtualAddress, PageSize pageSize);
+
+    // Map a page, creating intermediate tables when necessary. Fails with AlreadyMapped if the address is mapped.
+    std::optional<rlib::Error>
+    map(VirtualAddress virtualAddress, std::uint64_t physicalAddress, PageSize pageSize, PageFlags::Type flags);
+
+    /**
+     * Unmap the page covering virtualAddress, and free the page tables which become empty.
+     * 
+     * The page is added to gather, and so are the freed tables, which are released once the TLB has been flushed.
+     * 
+     * @returns The unmapped frame, which is left to the caller.
+     */
+    std::optional<Block> unmap(VirtualAddress virtualAddress, TlbGather& gather);
+
+private:
+    // Levels are numbered like the tables: level 4 is the root table, level 1 maps 4 KiB pages.
+    static constexpr std::size_t entrySize(std::uint8_t level);
+
+    // Level of the table of which the entries map pages of the given size.
+    static constexpr std::uint8_t level(std::size_t pageSize);
+
+    // Track the number of non-empty entries of the table at level.
+    void countEntries(std::uint8_t level, int delta);
+
+    static constexpr std::uintptr_t tag(VirtualAddress virtualAddress, std::uint8_t level);
+
+    // Lowest level, not below minimumLevel, of which the cursor holds the table covering virtualAddress.
+    std::uint8_t resolvedLevel(VirtualAddress virtualAddress, std::uint8_t minimumLevel) const;
+
+    void descend(VirtualAddress virtualAddress, std::uint8_t level, TableEntryView entry);
+
+    PageMapper*                             pageMapper;
+    std::array<std::optional<TableView>, 5> tables;
+    std::array<std::uintptr_t, 5>           tags;
+};
+
 class PageMapper {
 public:
     /**
@@ -212,45 +417,239 @@ public:
         PageSize        pageSize,
         PageFlags::Type flags);
 
+    std::optional<rlib::Error> mapRange(
+        TableView       addressSpace,
+        VirtualAddress  virtualAddress,
+        std::uint64_t   physicalAddress,
+        std::size_t     size,
+        PageSize        pageSize,
+        PageFlags::Type flags
+    );
+
     std::optional<std::uintptr_t> read(TableView addressSpace, VirtualAddress virtualAddress);
 
-    std::optional<Block> unmap(TableView addressSpace, VirtualAddress virtualAddress);
+    std::optional<Block> unmap(TableView addressSpace, VirtualAddress virtualAddress, TlbGather& gather);
 
-    std::optional<Block> unmapAndDeallocate(TableView addressSpace, VirtualAddress virtualAddress);
+    std::optional<Block> unmapAndDeallocate(TableView addressSpace, VirtualAddress virtualAddress, TlbGather& gather);
 
-    std::expected<PageFrame, rlib::Error> allocate();
+    std::expected<PageFrame, rlib::Error> allocate(PageSize pageSize = PageSize::_4KiB);
 
-    std::optional<rlib::Error>
-    allocateAndMap(TableView addressSpace, VirtualAddress virtualAddress, PageFlags::Type flags);
+    /**
+     * Allocate physically contiguous memory, for example for DMA buffers.
+     * 
+     * @param size Size in bytes, rounded up to a power of two number of frames.
+     */
+    std::expected<PageFrame, rlib::Error> allocateContiguous(std::size_t size);
+
+    void deallocate(std::uintptr_t physicalAddress, std::size_t size);
+
+    // See PageFrameAllocator::unusedMemory.
+    std::size_t unusedMemory() const;
+
+    // Reference counting of mapped frames, see PageFrameAllocator.
+    // Unmapping through unmapAndDeallocate(Range) releases a reference instead of deallocating unconditionally.
+
+    void acquire(std::uintptr_t physicalAddress, std::size_t size = 4_KiB);
+
+    bool release(std::uintptr_t physicalAddress, std::size_t size);
+
+    std::size_t references(std::uintptr_t physicalAddress, std::size_t size = 4_KiB);
+
+    VirtualAddress translate(std::uintptr_t physicalAddress) const;
+
+    // Physical address of an address in the identity mapping.
+    std::uintptr_t physicalAddress(VirtualAddress virtualAddress) const;
+
+    // Whether virtualAddress lies in the identity mapping of a frame managed by the frame allocator.
+    bool identityMapped(VirtualAddress virtualAddress);
+
+    /**
+     * A frame filled with zeros, shared by all read-only mappings of zero-initialized memory.
+     * 
+     * It is allocated on first use and never freed; reference counting treats it as pinned. Never map it writable.
+     */
+    std::expected<std::uintptr_t, rlib::Error> zeroFrame();
+
+    std::optional<rlib::Error> allocateAndMap(
+        TableView       addressSpace,
+        VirtualAddress  virtualAddress,
+        PageFlags::Type flags,
+        PageSize        pageSize = PageSize::_4KiB
+    );
 
     std::optional<rlib::Error> allocateAndMapRange(
-        TableView addressSpace, VirtualAddress virtualAddress, PageFlags::Type flags, std::size_t nFrames
+        TableView       addressSpace,
+        VirtualAddress  virtualAddress,
+        PageFlags::Type flags,
+        std::size_t     nPages,
+        PageSize        pageSize = PageSize::_4KiB
     );
 
-    std::size_t unmapAndDeallocateRange(TableView addressSpace, VirtualAddress virtualAddress, std::size_t size);
+    // The range operations below skip empty subtrees. They return the number of bytes of mapped memory they visited.
+    // Changed pages are added to gather, and frames are released once the TLB has been flushed.
 
-private:
-    std::expected<TableView, rlib::Error> ensurePageTable(TableEntryView entry);
+    std::size_t unmapAndDeallocateRange(
+        TableView addressSpace, VirtualAddress virtualAddress, std::size_t size, TlbGather& gather
+    );
+
+    std::size_t protectRange(
+        TableView       addressSpace,
+        VirtualAddress  virtualAddress,
+        std::size_t     size,
+        PageFlags::Type flags,
+        TlbGather&      gather
+    );
+
+    std::size_t queryRange(TableView addressSpace, VirtualAddress virtualAddress, std::size_t size);
 
     TableView mapTableView(TableEntryView entry) const;
 
-    IdentityMapping    identityMapping;
-    PageFrameAllocator frameAllocator;
+    /**
+     * Collapse the 4 KiB pages of the page table covering virtualAddress into a single 2 MiB page.
+     * 
+     * Only a full table of pages with identical flags, of which this address space holds the only reference, is
+     * collapsed. The old pages and their table are added to gather.
+     * 
+     * @returns True if the pages were collapsed.
+     */
+    bool promote(TableView addressSpace, VirtualAddress virtualAddress, TlbGather& gather);
+
+    /**
+     * Free the page tables below the root entries from startAddress to endAddress, and the root table itself.
+     * 
+     * Frames mapped by the tables are not released.
+     */
+    void destroyPageTables(TableView addressSpace, VirtualAddress startAddress, VirtualAddress endAddress);
+
+    /**
+     * Split the 2 MiB page covering virtualAddress into 4 KiB pages, so that they can be unmapped individually.
+     * 
+     * Does nothing if virtualAddress is not mapped by a 2 MiB page. Other address spaces may keep mapping a shared
+     * frame as a 2 MiB page; its frames are counted individually from then on.
+     */
+    std::optional<rlib::Error> demote(TableView addressSpace, VirtualAddress virtualAddress);
+
+private:
+    friend class PageTableCursor;
+
+    template<class Visitor>
+    void forEachMapping(TableView addressSpace, VirtualAddress virtualAddress, std::size_t size, Visitor&& visit);
+
+    void destroyTables(TableView table, std::uint8_t level, std::uint16_t firstIndex, std::uint16_t lastIndex);
+
+    IdentityMapping               identityMapping;
+    PageFrameAllocator            frameAllocator;
+    std::optional<std::uintptr_t> _zeroFrame;
+};
+
+// Invalidates the kernel half on the processors other than the calling one.
+class TlbShootdown {
+public:
+    // Returns once every other processor which might use the kernel half has flushed its TLB since flush number
+    // globalFlushes of TlbGather.
+    virtual void shootdown(std::uint64_t globalFlushes) = 0;
+
+protected:
+    ~TlbShootdown() = default;
+};
+
+/**
+ * Collects the pages of which a range operation changes the translation, and invalidates their TLB entries at once.
+ * 
+ * Frames that were unmapped, including page tables, may still be reachable through stale TLB entries. They are
+ * released to the frame allocator only after the flush. Up to Capacity pages are invalidated one by one; beyond that
+ * the whole TLB is flushed.
+ * 
+ * Only the TLB entries of the loaded address space, and global entries, can be invalidated, and only on the calling
+ * processor. An address space which is not loaded should drop its PCID instead, see AddressSpace::invalidateTlb.
+ * Other processors catch up when they next load the address space, see PcidAllocator. Changes to the kernel half are
+ * shot down on the other processors before any frame is released, see TlbShootdown.
+ */
+class TlbGather {
+public:
+    static constexpr auto Capacity = std::size_t(32);
+
+    TlbGather(PageMapper& pageMapper, TableView addressSpace);
+
+    TlbGather(const TlbGather&) = delete;
+
+    TlbGather& operator=(const TlbGather&) = delete;
+
+    // Record that the translation of the page covering virtualAddress changed.
+    void add(VirtualAddress virtualAddress);
+
+    // Release a reference to the frames of block once the TLB has been flushed.
+    void release(Block block);
+
+    // Release a page table once the TLB, including the cached entries of higher level tables, has been flushed.
+    void releaseTable(Block block);
+
+    // Invalidate the collected pages, then release the collected frames.
+    void flush();
+
+    // Whether the address space is loaded, so that its TLB entries can be invalidated directly.
+    bool loaded() const;
+
+    // The number of flushes which invalidated global entries so far. A processor which saw fewer must flush its own.
+    static std::uint64_t globalFlushes();
+
+    // Until set, changes to the kernel half are only invalidated on the calling processor.
+    static void setShootdown(TlbShootdown& shootdown);
+
+    ~TlbGather();
+
+private:
+    PageMapper*                          pageMapper;
+    TableView                            addressSpace;
+    std::array<std::uintptr_t, Capacity> pages;
+    std::size_t                          pageCount  = 0;
+    std::array<Block, Capacity>          frames;
+    std::size_t                          frameCount = 0;
+    bool                                 overflow   = false;
+    bool                                 global     = false;
+    bool                                 tables     = false;
+
+    static std::atomic<std::uint64_t> _globalFlushes;
+    static TlbShootdown*              _shootdown;
 };
 
 class AddressSpace;
 
-class Region : rlib::intrusive::ListNode<Region> {
+class Region : rlib::intrusive::TreeNode<Region> {
 public:
-    Region(AddressSpace& addressSpace, VirtualAddress virtualAddress, std::size_t sizeInFrames, PageFlags::Type pageFlags, PageSize pageSize);
+    Region(
+        AddressSpace&     addressSpace,
+        VirtualAddress    virtualAddress,
+        std::size_t       sizeInFrames,
+        PageFlags::Type   pageFlags,
+        PageSize          pageSize,
+        RegionFlags::Type regionFlags = 0
+    );
 
     std::optional<rlib::Error>
     mapPage(std::uint64_t physicalAddress, std::size_t pageIndex);
 
+    // Map a page through a cursor of the address space, for mapping many pages in a row.
+    std::optional<rlib::Error> mapPage(PageTableCursor& cursor, std::uint64_t physicalAddress, std::size_t pageIndex);
+
     std::optional<rlib::Error> allocatePage(std::size_t pageIndex);
 
     std::optional<rlib::Error> allocate();
 
+    /**
+     * Back part of the region with freshly allocated frames. The range must not be mapped yet.
+     * 
+     * Transparent huge page regions use 2 MiB pages where the range allows.
+     */
+    std::optional<rlib::Error> commit(std::size_t offset, std::size_t size);
+
+    /**
+     * Return the frames backing part of the region. The range stays reserved.
+     * 
+     * Huge pages which straddle the boundaries of the range are split first.
+     */
+    std::optional<rlib::Error> decommit(std::size_t offset, std::size_t size);
+
     std::optional<std::uint64_t> queryPhysicalAddress(std::size_t pageIndex) const;
 
     VirtualAddress start() const;
@@ -261,34 +660,58 @@ public:
 
     std::size_t sizeInFrames() const;
 
-
+    bool contains(VirtualAddress address) const;
 
     bool operator<(const Region& other) const;
 
 private:
-    friend class rlib::intrusive::NodeFromBase<Region, ListNode>;
+    friend class rlib::intrusive::NodeFromBase<Region, TreeNode>;
     friend class AddressSpace;
 
     std::size_t pageSizeInBytes() const;
 
-    AddressSpace*   addressSpace;
-    VirtualAddress  _start;
-    std::size_t     _sizeInFrames;
-    PageFlags::Type pageFlags;
-    PageSize        _pageSize;
+    // Whether the page flags of the region allow the faulting access.
+    bool permits(PageFaultFlags::Type faultFlags) const;
+
+    std::optional<rlib::Error> zeroFillPage(std::size_t pageIndex);
+
+    // Map a zeroed 2 MiB page covering address if the region has room for it.
+    bool zeroFillHugePage(VirtualAddress address);
+
+    // Whether the aligned 2 MiB page covering address lies within the region.
+    bool fitsHugePage(VirtualAddress address) const;
+
+    std::optional<rlib::Error> mapZeroPage(std::size_t pageIndex);
+
+    std::optional<rlib::Error> copyPage(std::size_t pageIndex);
+
+    AddressSpace*     addressSpace;
+    VirtualAddress    _start;
+    std::size_t       _sizeInFrames;
+    PageFlags::Type   pageFlags;
+    PageSize          _pageSize;
+    RegionFlags::Type regionFlags;
 };
 
 class AddressSpace {
 public:
+    // Regions by start address. Regions do not overlap, so this orders them by end address as well.
+    using Regions = rlib::intrusive::Tree<
+        Region,
+        rlib::intrusive::NodeFromBase<Region, rlib::intrusive::TreeNode>,
+        rlib::intrusive::ProjectMemberFunc<Region, VirtualAddress, &Region::start>>;
+
     static std::expected<rlib::OwningPointer<AddressSpace>, rlib::Error>
     make(PageMapper& pageMapper, rlib::Allocator& allocator, std::uintptr_t startAddress, std::size_t size);
 
     explicit AddressSpace(
         PageMapper&                   pageMapper,
         TableView                     tableLevel4,
-        rlib::intrusive::List<Region> regions,
+        Regions                       regions,
         rlib::MemoryResource          memoryResource,
-        rlib::Allocator&              allocator
+        rlib::Allocator&              allocator,
+        std::uintptr_t                startAddress,
+        std::size_t                   size
     );
 
     AddressSpace(AddressSpace&& other);
@@ -297,30 +720,116 @@ public:
 
     AddressSpace& operator=(const AddressSpace&) = delete;
 
-    std::expected<Region*, rlib::Error>
-    reserve(VirtualAddress start, std::size_t size, PageFlags::Type flags, PageSize pageSize);
+    std::expected<Region*, rlib::Error> reserve(
+        VirtualAddress    start,
+        std::size_t       size,
+        PageFlags::Type   flags,
+        PageSize          pageSize,
+        RegionFlags::Type regionFlags = 0
+    );
 
-    std::expected<Region*, rlib::Error> reserve(std::size_t size, PageFlags::Type flags, PageSize pageSize);
+    std::expected<Region*, rlib::Error>
+    reserve(std::size_t size, PageFlags::Type flags, PageSize pageSize, RegionFlags::Type regionFlags = 0);
+
+    std::expected<Region*, rlib::Error> allocate(
+        VirtualAddress    start,
+        std::size_t       size,
+        PageFlags::Type   flags,
+        PageSize          pageSize,
+        RegionFlags::Type regionFlags = 0
+    );
 
     std::expected<Region*, rlib::Error>
-    allocate(VirtualAddress start, std::size_t size, PageFlags::Type flags, PageSize pageSize);
+    allocate(std::size_t size, PageFlags::Type flags, PageSize pageSize, RegionFlags::Type regionFlags = 0);
 
-    std::expected<Region*, rlib::Error> allocate(std::size_t size, PageFlags::Type flags, PageSize pageSize);
+    // Reserve a region of which the pages are backed by zeroed frames on first access.
+    std::expected<Region*, rlib::Error> allocateOnDemand(std::size_t size, PageFlags::Type flags, PageSize pageSize);
+
+    /**
+     * Resolve a page fault at address.
+     * 
+     * @returns NotMapped if no region covers address, AccessViolation if the region does not allow the access.
+     */
+    std::optional<rlib::Error> handlePageFault(VirtualAddress address, PageFaultFlags::Type faultFlags);
+
+    // The region which contains address, if any.
+    Region* findRegion(VirtualAddress address) const;
+
+    // Regions which overlap size bytes from start, in address order.
+    std::ranges::subrange<Regions::Iterator> overlappingRegions(VirtualAddress start, std::size_t size) const;
 
     std::uintptr_t rootTablePhysicalAddress() const;
 
+    /**
+     * Drop the TLB entries cached for this address space.
+     *
+     * The address space gets a fresh PCID when it is next activated, so entries that were cached while it was
+     * inactive are never used again. Entries of the loaded address space are invalidated through a TlbGather instead.
+     */
+    void invalidateTlb();
+
+    PageTableCursor cursor();
+
     void shallowCopyRootMapping(const AddressSpace& from, VirtualAddress startAddress, VirtualAddress endAddress);
 
     std::expected<Region*, rlib::Error> share(Region& region, PageFlags::Type flags);
-    
+
+    /**
+     * Create an address space with the same regions and contents.
+     * 
+     * Frames are shared instead of copied. Writable pages are mapped read-only in both address spaces and copied on
+     * the first write. Shared regions are not cloned, and neither are mappings made outside of regions, such as the
+     * kernel half of a process address space.
+     * 
+     * Pages of this address space lose write access, and their TLB entries are invalidated.
+     */
+    std::expected<rlib::OwningPointer<AddressSpace>, rlib::Error> clone();
+
     ~AddressSpace();
 
 private:
     friend class Region;
+    friend class PcidAllocator;
 
     PageMapper*                   pageMapper;
     TableView                     tableLevel4;
-    rlib::intrusive::List<Region> regions;
+    Regions                       regions;
     rlib::MemoryResource          memoryResource;
     rlib::Allocator*              allocator;
+    std::uintptr_t                startAddress;
+    std::size_t                   size;
+    std::uint16_t                 pcid           = 0;
+    std::uint64_t                 pcidGeneration = 0;
+    // Index of the processor which loaded the address space last.
+    std::size_t                   pcidProcessor  = std::size_t(-1);
+};
+
+/**
+ * Hands out process-context identifiers (PCIDs) to address spaces, so that switching between them keeps their TLB
+ * entries.
+ *
+ * PCIDs are handed out in generations and are not recycled within a generation. When a generation runs out, address
+ * spaces are assigned a new PCID when they are next activated. PCID 0 is left to the kernel address space.
+ *
+ * Invalidations only reach the processor which makes them, and another processor may still cache entries of the
+ * address space which had a PCID before. So the entries of a PCID are only kept when its address space was loaded
+ * last on the same processor, with the same PCID.
+ */
+class PcidAllocator {
+public:
+    static constexpr auto MaxPcid = std::uint16_t(4095);
+
+    // Hand out PCIDs from now on. Call after enabling PCIDs on the processor.
+    void enable();
+
+    // Whether PCIDs are handed out. Every processor must enable PCIDs if so.
+    bool isEnabled() const;
+
+    // The value to load into CR3 to activate addressSpace on the processor with the given index.
+    std::uint64_t cr3(AddressSpace& addressSpace, std::size_t processor);
+
+private:
+    bool          enabled    = false;
+    std::uint64_t generation = 1;
+    std::uint16_t next       = 1;
 };
@@ -13,3 +13,28 @@ struct FrameBufferInfo {
 void initializePanicHandler(FrameBufferInfo frameBufferInfo);
 
 void panic(const char* message);
+
+// Writes text to the framebuffer, line by line, while the kernel panics.
+class PanicWriter {
+public:
+    PanicWriter& operator<<(const char* text);
+
+    PanicWriter& operator<<(std::uint64_t value);
+
+    void newLine();
+
+private:
+    std::uint32_t row    = 0;
+    std::uint32_t column = 0;
+};
+
+// Adds diagnostics below the panic message.
+class PanicObserver {
+public:
+    virtual void onPanic(PanicWriter& writer) = 0;
+
+protected:
+    ~PanicObserver() = default;
+};
+
+void setPanicObserver(PanicObserver& observer);
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include "paging.hpp"
+#include <libr/allocator.hpp>
+#include <libr/error.hpp>
+#include <libr/intrusive/list.hpp>
+#include <expected>
+#include <array>
+#include <bit>
+
+/**
+ * Allocator for small kernel objects, such as threads, regions and list nodes.
+ *
+ * Requests are rounded up to a power of two size class. Every size class has a cache of slabs: single frames filled
+ * with objects of that size, with a header at the end of the frame. Free objects are linked through their own storage,
+ * so allocation and deallocation take constant time. Slabs are returned to the page mapper once they become empty.
+ *
+ * Requests larger than MaxObjectSize fail, so that the allocator can be placed in front of a FallbackAllocator.
+ */
+class SlabAllocator : public rlib::Allocator {
+public:
+    static constexpr auto MinObjectSize = std::size_t(16);
+    static constexpr auto MaxObjectSize = std::size_t(1_KiB);
+    static constexpr auto SlabSize      = std::size_t(4_KiB);
+
+    static std::expected<SlabAllocator, rlib::Error> make(PageMapper& pageMapper, rlib::Allocator& allocator);
+
+private:
+    struct FreeObject {
+        FreeObject* next;
+    };
+
+    struct Slab {
+        rlib::intrusive::ListNode<Slab> node;
+        FreeObject*                     freeObjects;
+        std::uint16_t                   usedObjects;
+        std::uint8_t                    sizeClass;
+    };
+
+    static constexpr auto SizeClasses =
+        std::size_t(std::countr_zero(MaxObjectSize) - std::countr_zero(MinObjectSize) + 1);
+
+    using SlabList = rlib::intrusive::ListWithNodeMember<Slab, &Slab::node>;
+    // Per size class, the slabs which have free objects. Full slabs are not tracked.
+    using Caches = std::array<SlabList, SizeClasses>;
+
+    SlabAllocator(PageMapper& pageMapper, Caches caches);
+
+    // Index of the smallest size class which fits the request, or SizeClasses if there is none.
+    static std::size_t sizeClass(std::size_t bytes, std::size_t alignment);
+
+    static std::size_t objectSize(std::size_t sizeClass);
+
+    static Slab& slabOf(void* object);
+
+    Slab* grow(std::size_t sizeClass);
+
+    virtual void* do_allocate(std::size_t bytes, std::size_t alignment) final;
+
+    virtual void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) final;
+
+    virtual bool do_owns(void* p) const final;
+
+    PageMapper* pageMapper;
+    Caches      caches;
+};
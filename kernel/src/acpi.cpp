@@ -0,0 +1,199 @@
+#include <kernel/acpi.hpp>
+#include <algorithm>
+#include <cstddef>
+
+using namespace rlib;
+
+namespace {
+
+    struct __attribute__((packed)) RootSystemDescriptionPointer {
+        char          signature[8];
+        std::uint8_t  checksum;
+        char          oemId[6];
+        std::uint8_t  revision;
+        std::uint32_t rsdtAddress;
+        // Fields below are only valid from revision 2 on.
+        std::uint32_t length;
+        std::uint64_t xsdtAddress;
+        std::uint8_t  extendedChecksum;
+        std::uint8_t  reserved[3];
+    };
+
+    struct __attribute__((packed)) SystemDescriptionHeader {
+        char          signature[4];
+        std::uint32_t length;
+        std::uint8_t  revision;
+        std::uint8_t  checksum;
+        char          oemId[6];
+        char          oemTableId[8];
+        std::uint32_t oemRevision;
+        std::uint32_t creatorId;
+        std::uint32_t creatorRevision;
+    };
+
+    struct __attribute__((packed)) MadtHeader {
+        SystemDescriptionHeader header;
+        std::uint32_t           localApicAddress;
+        std::uint32_t           flags;
+    };
+
+    struct __attribute__((packed)) MadtEntry {
+        std::uint8_t type;
+        std::uint8_t length;
+    };
+
+    struct __attribute__((packed)) MadtIoApicEntry {
+        MadtEntry     entry;
+        std::uint8_t  id;
+        std::uint8_t  reserved;
+        std::uint32_t address;
+        std::uint32_t gsiBase;
+    };
+
+    struct __attribute__((packed)) MadtOverrideEntry {
+        MadtEntry     entry;
+        std::uint8_t  bus;
+        std::uint8_t  source;
+        std::uint32_t gsi;
+        std::uint16_t flags;
+    };
+
+    struct __attribute__((packed)) MadtLocalApicAddressEntry {
+        MadtEntry     entry;
+        std::uint16_t reserved;
+        std::uint64_t address;
+    };
+
+    constexpr auto MadtPcAtCompatible = std::uint32_t(1);
+
+    constexpr auto IoApicEntryType           = std::uint8_t(1);
+    constexpr auto OverrideEntryType         = std::uint8_t(2);
+    constexpr auto LocalApicAddressEntryType = std::uint8_t(5);
+
+    bool hasSignature(const char* signature, const char* expected, std::size_t size)
+    {
+        return std::equal(signature, signature + size, expected);
+    }
+
+    // The bytes of every ACPI table sum to zero.
+    bool checksumValid(const void* table, std::size_t size)
+    {
+        auto bytes = static_cast<const std::uint8_t*>(table);
+        auto sum   = std::uint8_t(0);
+        for (auto i = std::size_t(0); i < size; i++) {
+            sum += bytes[i];
+        }
+
+        return sum == 0;
+    }
+
+    const SystemDescriptionHeader* table(IdentityMapping identityMapping, std::uintptr_t physicalAddress)
+    {
+        auto header = identityMapping.translate(physicalAddress).ptr<const SystemDescriptionHeader>();
+        if (header->length < sizeof(SystemDescriptionHeader) || !checksumValid(header, header->length)) {
+            return nullptr;
+        }
+
+        return header;
+    }
+
+    std::expected<Madt, Error> parseMadtEntries(const MadtHeader& header)
+    {
+        auto madt              = Madt{};
+        madt.localApicAddress  = header.localApicAddress;
+        madt.legacyPics        = (header.flags & MadtPcAtCompatible) != 0;
+        madt.numberOfIoApics   = 0;
+        madt.numberOfOverrides = 0;
+
+        auto entries = reinterpret_cast<const std::byte*>(&header) + sizeof(MadtHeader);
+        auto end     = reinterpret_cast<const std::byte*>(&header) + header.header.length;
+        while (entries + sizeof(MadtEntry) <= end) {
+            auto entry = reinterpret_cast<const MadtEntry*>(entries);
+            if (entry->length < sizeof(MadtEntry) || entries + entry->length > end) {
+                return std::unexpected(InvalidAcpiTable);
+            }
+
+            if (entry->type == IoApicEntryType && entry->length >= sizeof(MadtIoApicEntry) &&
+                madt.numberOfIoApics < Madt::MaxIoApics) {
+                auto ioApic                          = reinterpret_cast<const MadtIoApicEntry*>(entry);
+                madt.ioApics[madt.numberOfIoApics++] = IoApicInfo{ioApic->id, ioApic->address, ioApic->gsiBase};
+            } else if (entry->type == OverrideEntryType && entry->length >= sizeof(MadtOverrideEntry) &&
+                       madt.numberOfOverrides < Madt::MaxOverrides) {
+                auto isaOverride = reinterpret_cast<const MadtOverrideEntry*>(entry);
+                madt.overrides[madt.numberOfOverrides++] =
+                    InterruptOverride{isaOverride->source, isaOverride->gsi, isaOverride->flags};
+            } else if (entry->type == LocalApicAddressEntryType && entry->length >= sizeof(MadtLocalApicAddressEntry)) {
+                madt.localApicAddress = reinterpret_cast<const MadtLocalApicAddressEntry*>(entry)->address;
+            }
+
+            entries += entry->length;
+        }
+
+        if (madt.numberOfIoApics == 0) {
+            return std::unexpected(InvalidAcpiTable);
+        }
+
+        return madt;
+    }
+
+} // namespace
+
+InterruptOverride Madt::route(std::uint8_t irq) const
+{
+    for (auto i = std::size_t(0); i < numberOfOverrides; i++) {
+        if (overrides[i].irq == irq) {
+            return overrides[i];
+        }
+    }
+
+    // ISA interrupts are identity mapped, active high and edge triggered unless overridden.
+    return InterruptOverride{irq, irq, 0};
+}
+
+std::expected<Madt, Error> parseMadt(IdentityMapping identityMapping, std::uintptr_t physicalAddress)
+{
+    if (physicalAddress == 0) {
+        return std::unexpected(MadtNotFound);
+    }
+
+    // The boot loader hands over either the RSDP or the root table it points to.
+    auto rootAddress = physicalAddress;
+    auto rsdp        = identityMapping.translate(physicalAddress).ptr<const RootSystemDescriptionPointer>();
+    if (hasSignature(rsdp->signature, "RSD PTR ", sizeof(rsdp->signature))) {
+        if (!checksumValid(rsdp, offsetof(RootSystemDescriptionPointer, length))) {
+            return std::unexpected(InvalidAcpiTable);
+        }
+        auto extended = rsdp->revision >= 2 && rsdp->xsdtAddress != 0 && checksumValid(rsdp, rsdp->length);
+        rootAddress   = extended ? rsdp->xsdtAddress : rsdp->rsdtAddress;
+    }
+
+    auto root = table(identityMapping, rootAddress);
+    if (root == nullptr) {
+        return std::unexpected(InvalidAcpiTable);
+    }
+
+    // The XSDT lists 64 bit addresses, the RSDT 32 bit ones. Neither is aligned for its entries.
+    auto entrySize = std::size_t(0);
+    if (hasSignature(root->signature, "XSDT", sizeof(root->signature))) {
+        entrySize = sizeof(std::uint64_t);
+    } else if (hasSignature(root->signature, "RSDT", sizeof(root->signature))) {
+        entrySize = sizeof(std::uint32_t);
+    } else {
+        return std::unexpected(InvalidAcpiTable);
+    }
+
+    auto entries         = reinterpret_cast<const std::byte*>(root) + sizeof(SystemDescriptionHeader);
+    auto numberOfEntries = (root->length - sizeof(SystemDescriptionHeader)) / entrySize;
+    for (auto i = std::size_t(0); i < numberOfEntries; i++) {
+        auto address = std::uint64_t(0);
+        std::copy_n(entries + i * entrySize, entrySize, reinterpret_cast<std::byte*>(&address));
+
+        auto header = table(identityMapping, address);
+        if (header != nullptr && header->length >= sizeof(MadtHeader) &&
+            hasSignature(header->signature, "APIC", sizeof(header->signature))) {
+            return parseMadtEntries(*reinterpret_cast<const MadtHeader*>(header));
+        }
+    }
+
+    return std::unexpected(MadtNotFound);
+}
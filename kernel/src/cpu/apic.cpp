@@ -0,0 +1,320 @@
+#include <kernel/apic.hpp>
+#include <kernel/cpu.hpp>
+#include <algorithm>
+
+using namespace rlib;
+
+extern "C" void maskPIC();
+
+extern "C" void waitForPitReload();
+
+namespace {
+
+    constexpr auto X2ApicFeature      = std::uint32_t(1) << 21; // CPUID.01H:ECX
+    constexpr auto TscDeadlineFeature = std::uint32_t(1) << 24; // CPUID.01H:ECX
+    constexpr auto ApicGlobalEnable   = std::uint64_t(1) << 11;
+    constexpr auto X2ApicEnable       = std::uint64_t(1) << 10;
+    constexpr auto ApicSoftwareEnable = std::uint32_t(1) << 8;
+    constexpr auto X2ApicMsrBase      = std::uint32_t(0x800);
+
+    // Local vector table entry of the timer. One-shot mode is zero.
+    constexpr auto MaskedTimer     = std::uint32_t(1) << 16;
+    constexpr auto TscDeadlineMode = std::uint32_t(2) << 17;
+    constexpr auto TimerDivideBy1  = std::uint32_t(0xb);
+    constexpr auto MaxTimerCount   = std::uint32_t(0xffffffff);
+
+    // Interrupt command register
+    constexpr auto LevelAssert     = std::uint32_t(1) << 14;
+    constexpr auto DeliveryPending = std::uint32_t(1) << 12;
+
+    // IO-APIC registers are selected through one register and accessed through another.
+    constexpr auto IoRegisterSelect = std::uintptr_t(0x00);
+    constexpr auto IoWindow         = std::uintptr_t(0x10);
+
+    // IO-APIC redirection entry, low half
+    constexpr auto ActiveLowEntry      = std::uint32_t(1) << 13;
+    constexpr auto LevelTriggeredEntry = std::uint32_t(1) << 15;
+    constexpr auto MaskedEntry         = std::uint32_t(1) << 16;
+
+    bool supports(std::uint32_t feature)
+    {
+        std::uint32_t eax, ebx, ecx, edx;
+        asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+
+        return (ecx & feature) != 0;
+    }
+
+    // Maps the page of registers at physicalAddress uncached into the kernel half, which every processor shares.
+    std::expected<VirtualAddress, Error> mapRegisters(AddressSpace& kernelAddressSpace, std::uint64_t physicalAddress)
+    {
+        constexpr auto flags = PageFlags::Present | PageFlags::Writable | PageFlags::NoExecute | PageFlags::Global
+                             | PageFlags::WriteThrough | PageFlags::CacheDisable;
+
+        auto region = kernelAddressSpace.reserve(4_KiB, flags, PageSize::_4KiB);
+        if (!region) {
+            return std::unexpected(region.error());
+        }
+
+        auto page  = physicalAddress & ~std::uint64_t(4_KiB - 1);
+        auto error = (*region)->mapPage(page, 0);
+        if (error) {
+            return std::unexpected(*error);
+        }
+
+        return VirtualAddress((*region)->start() + (physicalAddress - page));
+    }
+
+} // namespace
+
+bool           LocalApic::active         = false;
+bool           LocalApic::x2Apic         = false;
+VirtualAddress LocalApic::registers      = VirtualAddress(std::uintptr_t(0));
+bool           LocalApic::tscDeadline    = false;
+std::uint8_t   LocalApic::timerVector    = 0;
+std::uint64_t  LocalApic::timerFrequency = 0;
+
+std::optional<Error>
+LocalApic::initialize(AddressSpace& kernelAddressSpace, std::uint64_t physicalAddress, std::uint8_t timerVector)
+{
+    x2Apic = supports(X2ApicFeature);
+    if (!x2Apic) {
+        auto mapped = mapRegisters(kernelAddressSpace, physicalAddress);
+        if (!mapped) {
+            return mapped.error();
+        }
+        registers = *mapped;
+    }
+    tscDeadline            = supports(TscDeadlineFeature);
+    LocalApic::timerVector = timerVector;
+
+    maskPIC();
+    active = true;
+    enable();
+
+    // In one-shot mode the timer counts at the rate of the bus clock, which is measured against a period of the PIT.
+    // Interrupts are still disabled, so the PIT is polled.
+    if (!tscDeadline) {
+        write(RegisterOffset::LvtTimer, MaskedTimer | timerVector);
+        waitForPitReload();
+        auto start = Register::TSC::read();
+        write(RegisterOffset::TimerInitialCount, MaxTimerCount);
+        waitForPitReload();
+        auto counts = MaxTimerCount - read(RegisterOffset::TimerCurrentCount);
+        auto cycles = Register::TSC::read() - start;
+        write(RegisterOffset::TimerInitialCount, 0);
+        write(RegisterOffset::LvtTimer, timerVector);
+
+        timerFrequency = counts * Cpu::tscFrequency() / cycles;
+    }
+
+    return {};
+}
+
+bool LocalApic::isActive()
+{
+    return active;
+}
+
+void LocalApic::enable()
+{
+    // The x2APIC mode can only be entered from the xAPIC mode.
+    auto apicBase = Register::MSR::read(Register::MSR::ApicBase) | ApicGlobalEnable;
+    Register::MSR::write(Register::MSR::ApicBase, apicBase);
+    if (x2Apic) {
+        Register::MSR::write(Register::MSR::ApicBase, apicBase | X2ApicEnable);
+    }
+
+    write(RegisterOffset::SpuriousInterrupt, ApicSoftwareEnable | SpuriousVector);
+
+    // The timer stays idle until a deadline is set.
+    if (tscDeadline) {
+        write(RegisterOffset::LvtTimer, TscDeadlineMode | timerVector);
+        // Writes to the deadline MSR are not ordered after writes to the memory mapped registers.
+        asm volatile("mfence" : : : "memory");
+    } else {
+        write(RegisterOffset::TimerDivide, TimerDivideBy1);
+        write(RegisterOffset::LvtTimer, timerVector);
+    }
+}
+
+std::uint32_t LocalApic::id()
+{
+    auto id = read(RegisterOffset::Id);
+
+    return x2Apic ? id : id >> 24;
+}
+
+void LocalApic::endOfInterrupt()
+{
+    write(RegisterOffset::EndOfInterrupt, 0);
+}
+
+void LocalApic::sendIpi(std::uint32_t apicId, std::uint8_t vector)
+{
+    if (x2Apic) {
+        // The x2APIC interrupt command register is a single MSR, so the interrupt is sent by one write.
+        auto command = std::uint64_t(apicId) << 32 | LevelAssert | vector;
+        Register::MSR::write(X2ApicMsrBase + RegisterOffset::InterruptCommand / 16, command);
+        return;
+    }
+
+    // Writing the low half sends the interrupt.
+    write(RegisterOffset::InterruptCommand2, apicId << 24);
+    write(RegisterOffset::InterruptCommand, LevelAssert | vector);
+    while ((read(RegisterOffset::InterruptCommand) & DeliveryPending) != 0) {
+        Cpu::pause();
+    }
+}
+
+void LocalApic::setDeadline(std::uint64_t deadline)
+{
+    if (tscDeadline) {
+        Register::MSR::write(Register::MSR::TscDeadline, deadline);
+        return;
+    }
+
+    // A count of zero stops the timer, so a deadline which has passed gets the shortest count instead.
+    // The product of cycles and the timer frequency may not fit in 64 bits, so the whole seconds are scaled apart.
+    auto now       = Register::TSC::read();
+    auto cycles    = deadline > now ? deadline - now : 0;
+    auto frequency = Cpu::tscFrequency();
+    auto count     = cycles / frequency * timerFrequency + cycles % frequency * timerFrequency / frequency;
+    write(RegisterOffset::TimerInitialCount, std::uint32_t(std::clamp<std::uint64_t>(count, 1, MaxTimerCount)));
+}
+
+void LocalApic::clearDeadline()
+{
+    if (tscDeadline) {
+        Register::MSR::write(Register::MSR::TscDeadline, 0);
+        return;
+    }
+
+    write(RegisterOffset::TimerInitialCount, 0);
+}
+
+std::uint32_t LocalApic::read(RegisterOffset::Type offset)
+{
+    if (x2Apic) {
+        return std::uint32_t(Register::MSR::read(X2ApicMsrBase + offset / 16));
+    }
+
+    return *reinterpret_cast<volatile std::uint32_t*>(registers + offset);
+}
+
+void LocalApic::write(RegisterOffset::Type offset, std::uint32_t value)
+{
+    if (x2Apic) {
+        Register::MSR::write(X2ApicMsrBase + offset / 16, value);
+        return;
+    }
+
+    *reinterpret_cast<volatile std::uint32_t*>(registers + offset) = value;
+}
+
+IoApic::IoApic(VirtualAddress registers, std::uint32_t gsiBase) : registers(registers), gsiBase(gsiBase)
+{
+    // The version register holds the index of the last redirection entry.
+    size = ((read(RegisterIndex::Version) >> 16) & 0xff) + 1;
+}
+
+bool IoApic::handles(std::uint32_t gsi) const
+{
+    return size > 0 && gsi >= gsiBase && gsi - gsiBase < size;
+}
+
+void IoApic::route(std::uint32_t gsi, std::uint8_t vector, std::uint32_t apicId, InterruptOverride::Flags::Type flags)
+{
+    auto entry = std::uint32_t(vector); // Fixed delivery to a physical destination
+    if ((flags & InterruptOverride::Flags::PolarityMask) == InterruptOverride::Flags::ActiveLow) {
+        entry |= ActiveLowEntry;
+    }
+    if ((flags & InterruptOverride::Flags::TriggerMask) == InterruptOverride::Flags::LevelTriggered) {
+        entry |= LevelTriggeredEntry;
+    }
+
+    // Keep the entry masked while it is half written.
+    auto index = RegisterIndex::RedirectionBase + 2 * (gsi - gsiBase);
+    write(index, MaskedEntry);
+    write(index + 1, apicId << 24);
+    write(index, entry);
+}
+
+void IoApic::mask(std::uint32_t gsi)
+{
+    auto index = RegisterIndex::RedirectionBase + 2 * (gsi - gsiBase);
+    write(index, read(index) | MaskedEntry);
+}
+
+void IoApic::maskAll()
+{
+    for (auto gsi = gsiBase; gsi - gsiBase < size; gsi++) {
+        mask(gsi);
+    }
+}
+
+std::uint32_t IoApic::read(RegisterIndex::Type index) const
+{
+    *reinterpret_cast<volatile std::uint32_t*>(registers + IoRegisterSelect) = index;
+
+    return *reinterpret_cast<volatile std::uint32_t*>(registers + IoWindow);
+}
+
+void IoApic::write(RegisterIndex::Type index, std::uint32_t value)
+{
+    *reinterpret_cast<volatile std::uint32_t*>(registers + IoRegisterSelect) = index;
+    *reinterpret_cast<volatile std::uint32_t*>(registers + IoWindow)         = value;
+}
+
+std::expected<InterruptRouter, Error> InterruptRouter::make(const Madt& madt, AddressSpace& kernelAddressSpace)
+{
+    auto ioApics = std::array<IoApic, Madt::MaxIoApics>{};
+    for (auto i = std::size_t(0); i < madt.numberOfIoApics; i++) {
+        auto registers = mapRegisters(kernelAddressSpace, madt.ioApics[i].physicalAddress);
+        if (!registers) {
+            return std::unexpected(registers.error());
+        }
+
+        // The firmware may leave entries unmasked; interrupts are only delivered once routed.
+        ioApics[i] = IoApic(*registers, madt.ioApics[i].gsiBase);
+        ioApics[i].maskAll();
+    }
+
+    return InterruptRouter(madt, ioApics);
+}
+
+InterruptRouter::InterruptRouter(const Madt& madt, std::array<IoApic, Madt::MaxIoApics> ioApics) :
+    madt(madt), ioApics(ioApics)
+{}
+
+std::optional<Error> InterruptRouter::route(std::uint8_t irq, std::uint8_t vector, std::uint32_t apicId)
+{
+    // Without interrupt remapping, an IO-APIC addresses local APICs by 8 bit IDs.
+    auto source = madt.route(irq);
+    auto ioApic = find(source.gsi);
+    if (ioApic == nullptr || apicId > 0xff) {
+        return UnroutableInterrupt;
+    }
+
+    ioApic->route(source.gsi, vector, apicId, source.flags);
+
+    return {};
+}
+
+void InterruptRouter::mask(std::uint8_t irq)
+{
+    auto source = madt.route(irq);
+    if (auto ioApic = find(source.gsi); ioApic != nullptr) {
+        ioApic->mask(source.gsi);
+    }
+}
+
+IoApic* InterruptRouter::find(std::uint32_t gsi)
+{
+    for (auto& ioApic : ioApics) {
+        if (ioApic.handles(gsi)) {
+            return &ioApic;
+        }
+    }
+
+    return nullptr;
+}
@@ -2,6 +2,10 @@
 section .note.GNU-stack noalloc noexec nowrite progbits
 
 FlagsKernelMode         equ     1
+FlagsFullState          equ     2
+
+UserDataSelector        equ     3 << 3 | 3
+UserCodeSelector        equ     4 << 3 | 3
 
 struc Context
     .rflags             resq    1 ; RFLAGS register
@@ -14,12 +18,22 @@ struc Context
     .r13                resq    1
     .r14                resq    1
     .r15                resq    1
+    .rax                resq    1 ; Caller-saved registers, only valid with FlagsFullState
+    .rcx                resq    1
+    .rdx                resq    1
+    .rsi                resq    1
+    .rdi                resq    1
+    .r8                 resq    1
+    .r9                 resq    1
+    .r10                resq    1
+    .r11                resq    1
     .flags              resw    1 ; Context flags
 endstruc
 
 struc Core
     .kernelStack        resq    1
     .activeContext      resq    1 
+    .cpu                resq    1
 endstruc
 
 section .text
@@ -28,10 +42,16 @@ global setGdt
 global setIdt
 global notifyEndOfInterrupt
 global initializePIC
+global maskPIC
 global switchContext
 global setupSyscallHandler
+global initializePIT
+global waitForPitReload
+global timerInterruptThunk
+global enterAddressSpace
 
 extern systemCallHandler
+extern timerInterruptHandler
 
 MasterPicCommandPort    equ     0x20
 MasterPicDataPort       equ     MasterPicCommandPort + 1
@@ -41,6 +61,10 @@ PicCommandEOI           equ     0x20
 PicCommandInit          equ     0x11
 PicCommandReadISR       equ     0x0b
 ICW4_8086               equ     0x01
+PitChannel0Port         equ     0x40
+PitCommandPort          equ     0x43
+PitRateGenerator        equ     0x34    ; Channel 0, low byte then high byte, mode 2
+PitLatchChannel0        equ     0x00    ; Channel 0, latch the count
 
 ; di:  gdt limit 
 ; rsi:  gdt base
@@ -118,14 +142,55 @@ initializePIC:
     out     MasterPicDataPort, al
     out     SlavePicDataPort, al
 
-    ; Set interrupt masks to keyboard only
-    mov     al, 0xf9
+    ; Set interrupt masks to timer and keyboard only
+    mov     al, 0xf8
     out     MasterPicDataPort, al
     mov     al, 0xff
     out     SlavePicDataPort, al
 
     ret
 
+; Masks every interrupt of both PICs, when the APICs take over. The PICs stay remapped, so that a spurious
+; interrupt they still raise does not land on an exception vector.
+maskPIC:
+    mov     al, 0xff
+    out     MasterPicDataPort, al
+    out     SlavePicDataPort, al
+    ret
+
+; di:   divisor of the 1.193182 MHz input clock
+initializePIT:
+    mov     al, PitRateGenerator
+    out     PitCommandPort, al
+    mov     ax, di
+    out     PitChannel0Port, al
+    mov     al, ah
+    out     PitChannel0Port, al
+    ret
+
+; Spins until the counter of PIT channel 0 reloads, which it does once per period. The counter is read through latch
+; commands, so the timer interrupt need not be enabled.
+waitForPitReload:
+    call    readPitCount
+.wait:
+    mov     ecx, eax                ; The counter counts down until it reloads with the divisor
+    call    readPitCount
+    cmp     eax, ecx
+    jbe     .wait
+    ret
+
+; return: count of PIT channel 0
+readPitCount:
+    mov     al, PitLatchChannel0
+    out     PitCommandPort, al
+    in      al, PitChannel0Port     ; Low byte
+    mov     dl, al
+    in      al, PitChannel0Port     ; High byte
+    mov     ah, al
+    mov     al, dl
+    movzx   eax, ax
+    ret
+
 ; dil:  IRQ 
 ; return: boolean indicating if IRQ is spurious
 notifyEndOfInterrupt:
@@ -159,11 +224,31 @@ notifyEndOfInterrupt:
     xor     rax, rax
     ret
 
+; rdi:  root page table physical address
+; rsi:  stack top
+; rdx:  entry point
+; rcx:  argument to the entry point
+enterAddressSpace:
+    mov     cr3, rdi
+    mov     rsp, rsi                ; The old stack may be gone with the old address space
+    xor     ebp, ebp
+    mov     rdi, rcx
+    call    rdx
+.hang:                              ; The entry point does not return
+    cli
+    hlt
+    jmp     .hang
+
 ; rdi: target context
 switchContext:
     ; save active context
     mov     rsi, qword [gs:Core.activeContext]
     mov     rax, cr3
+    mov     rdx, cr4
+    bt      rdx, 17                 ; CR4.PCIDE
+    jnc     .save_cr3
+    bts     rax, 63                 ; Keep the TLB entries of this PCID when switching back
+.save_cr3:
     mov     [rsi + Context.cr3], rax
     pop     qword [rsi + Context.rip]   ; We are jumping out of this function
     or      qword [rsi + Context.flags], FlagsKernelMode      
@@ -189,23 +274,112 @@ loadContext:
     mov     r13, [rdi + Context.r13]
     mov     r14, [rdi + Context.r14]
     mov     r15, [rdi + Context.r15]
-    mov     rsp, [rdi + Context.rsp]
-    mov     rbp, [rdi + Context.rbp]
     mov     rax, [rdi + Context.cr3]
+    mov     rdx, cr3
+    mov     rcx, rax
+    btr     rcx, 63                 ; CR3 reads without the no-flush bit
+    cmp     rcx, rdx
+    je      .same_address_space     ; Skip the serializing write when the address space stays loaded
     mov     cr3, rax
+.same_address_space:
 
-    test    dword [rdi + Context.flags], FlagsKernelMode
+    test    word [rdi + Context.flags], FlagsKernelMode
     jz      .return_to_user_mode
     ; Stay in kernel mode
+    mov     rsp, [rdi + Context.rsp]
     push    qword [rdi + Context.rflags]  ; Restore rflags 
     popfq   
     jmp     [rdi + Context.rip]
 
 .return_to_user_mode:
+    test    word [rdi + Context.flags], FlagsFullState
+    jnz     .return_from_interrupt
+    mov     rsp, [rdi + Context.rsp]
     mov     rcx, [rdi + Context.rip]
     mov     r11, [rdi + Context.rflags]
     o64 sysret
 
+.return_from_interrupt:
+    ; The context was saved on preemption; restore every register. The frame goes on the kernel stack we are on.
+    push    qword UserDataSelector
+    push    qword [rdi + Context.rsp]
+    push    qword [rdi + Context.rflags]
+    push    qword UserCodeSelector
+    push    qword [rdi + Context.rip]
+    mov     rax, [rdi + Context.rax]
+    mov     rcx, [rdi + Context.rcx]
+    mov     rdx, [rdi + Context.rdx]
+    mov     rsi, [rdi + Context.rsi]
+    mov     r8, [rdi + Context.r8]
+    mov     r9, [rdi + Context.r9]
+    mov     r10, [rdi + Context.r10]
+    mov     r11, [rdi + Context.r11]
+    mov     rdi, [rdi + Context.rdi]
+    iretq
+
+; Timer interrupt. User mode is preempted: its full state is saved, and the handler picks the context to continue
+; with. Kernel mode is only interrupted, as the kernel thread gives up the processor at points of its own choosing.
+timerInterruptThunk:
+    test    qword [rsp + 8], 3          ; Privilege level of the interrupted code segment
+    jz      .kernel_mode
+
+    push    rax
+    mov     rax, qword [gs:Core.activeContext]
+    mov     [rax + Context.rbx], rbx
+    mov     [rax + Context.rcx], rcx
+    mov     [rax + Context.rdx], rdx
+    mov     [rax + Context.rsi], rsi
+    mov     [rax + Context.rdi], rdi
+    mov     [rax + Context.rbp], rbp
+    mov     [rax + Context.r8], r8
+    mov     [rax + Context.r9], r9
+    mov     [rax + Context.r10], r10
+    mov     [rax + Context.r11], r11
+    mov     [rax + Context.r12], r12
+    mov     [rax + Context.r13], r13
+    mov     [rax + Context.r14], r14
+    mov     [rax + Context.r15], r15
+    pop     qword [rax + Context.rax]
+    mov     rcx, [rsp]                  ; Interrupt frame: rip, cs, rflags, rsp, ss
+    mov     [rax + Context.rip], rcx
+    mov     rcx, [rsp + 16]
+    mov     [rax + Context.rflags], rcx
+    mov     rcx, [rsp + 24]
+    mov     [rax + Context.rsp], rcx
+    and     word [rax + Context.flags], ~FlagsKernelMode
+    or      word [rax + Context.flags], FlagsFullState
+
+    sub     rsp, 8                      ; Align the stack for the call
+    cld
+    mov     edi, 1
+    call    timerInterruptHandler
+    mov     rdi, rax
+    jmp     loadContext
+
+.kernel_mode:
+    push    rax
+    push    rcx
+    push    rdx
+    push    rsi
+    push    rdi
+    push    r8
+    push    r9
+    push    r10
+    push    r11
+    cld
+    xor     edi, edi
+    call    timerInterruptHandler
+    pop     r11
+    pop     r10
+    pop     r9
+    pop     r8
+    pop     rdi
+    pop     rsi
+    pop     rdx
+    pop     rcx
+    pop     rax
+    iretq
+
 ; rdi:  receiver id
 ; rsi:  message size
 ; rdx:  param 1
@@ -214,7 +388,8 @@ loadContext:
 ; r9:   param 4
 systemCallThunk:
     mov     rax, qword [gs:Core.activeContext]
-    and     dword [rax + Context.flags], !FlagsKernelMode
+    and     word [rax + Context.flags], ~(FlagsKernelMode | FlagsFullState)
+    mov     [rax + Context.rip], rcx
     mov     [rax + Context.rflags], r11
     mov     [rax + Context.rbx], rbx
     mov     [rax + Context.rbp], rbp
@@ -253,9 +428,9 @@ setupSyscallHandler:
     shr     rdx, 32
     wrmsr                           ; Write to IA32_LSTAR
 
-    ; SECURITY RISK - EVALUATE
     mov     ecx, 0xC0000084         ; IA32_FMASK MSR address
-    xor     edx, edx                ; We do not mask any flags -- for now
+    xor     edx, edx
+    mov     eax, 0x600              ; Clear IF and DF: system calls are not preempted by the timer
     wrmsr                           ; Write to IA32_FMASK
     
     mov     ecx, 0xC0000080         ; IA32_EFER MSR address
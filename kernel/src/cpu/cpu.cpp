@@ -1,7 +1,8 @@
 #include <kernel/cpu.hpp>
+#include <kernel/apic.hpp>
 #include <kernel/panic.hpp>
 #include <tuple>
-#include <kernel/cpu.hpp>
+#include <cstddef>
 #include <libr/allocator.hpp>
 
 extern "C" void
@@ -18,6 +19,15 @@ setupSyscallHandler(std::uint16_t kernelCodeSegmentIndex, std::uint16_t userCode
 
 extern "C" void switchContext(Context* context);
 
+extern "C" void initializePIT(std::uint16_t divisor);
+
+extern "C" void waitForPitReload();
+
+extern "C" void timerInterruptThunk();
+
+extern "C" [[noreturn]] void
+enterAddressSpace(std::uint64_t rootPageTablePhysicalAddress, void* stackTop, void (*entry)(void*), void* argument);
+
 struct GdtAccess {
     using Type                             = std::uint8_t;
     static constexpr auto ReadableWritable = Type(1) << 1;
@@ -102,58 +112,136 @@ __attribute__((interrupt)) void doubleFaultHandler(InterruptFrame*, std::uint64_
     panic("Double fault");
 };
 
+__attribute__((interrupt)) void pageFaultHandler(InterruptFrame*, std::uint64_t errorCode)
+{
+    auto& cpu     = Cpu::current();
+    auto  address = VirtualAddress(Register::CR2::read());
+    if (cpu.observer == nullptr || !cpu.observer->onPageFault(*cpu.core.activeContext, address, errorCode)) {
+        panic("Page fault");
+    }
+}
+
+// Acknowledges irq at the controller which delivered it. Returns true if the PICs report it as spurious.
+bool endOfInterrupt(std::uint8_t irq)
+{
+    if (LocalApic::isActive()) {
+        LocalApic::endOfInterrupt();
+        return false;
+    }
+
+    return notifyEndOfInterrupt(irq);
+}
+
 template<std::uint8_t Irq>
 __attribute__((interrupt)) void hardwareInterruptHandler(InterruptFrame*)
 {
-    auto& cpu = Cpu::getInstance();
+    auto& cpu = Cpu::current();
     if (cpu.observer != nullptr) {
         cpu.observer->onInterrupt(Irq);
     }
 
-    auto spurious = notifyEndOfInterrupt(Irq);
+    auto spurious = endOfInterrupt(Irq);
     if (spurious) {
         cpu.spuriousIRQCount++;
     }
 }
 
-Cpu::Cpu(void* interruptStack, void* syscallStack, Context& initialContext) :
-    gdt{0}, idt{{0, 0}}, tss{}, spuriousIRQCount(0), observer{nullptr}
+// A local APIC raises its spurious vector when an interrupt goes away before it is delivered. It takes no EOI.
+__attribute__((interrupt)) void spuriousInterruptHandler(InterruptFrame*)
 {
-    setupGdt(interruptStack);
+    Cpu::current().spuriousIRQCount++;
+}
+
+Cpu::Cpu(
+    std::uint32_t index, void* interruptStack, void* pageFaultStack, void* syscallStack, Context& initialContext
+) :
+    gdt{0}, idt{{0, 0}}, tss{}, spuriousIRQCount(0), _index(index), _apicId(localApicId()), observer{nullptr}
+{
+    setupGdt(interruptStack, pageFaultStack);
     setupIdt();
     setupSyscall(syscallStack, initialContext);
-    initializePIC(IdtHardwareInterruptBase, IdtHardwareInterruptBase + 8);
+    if (index == 0) {
+        constexpr auto divisor = PitFrequency / TimerFrequency;
+        initializePIC(IdtHardwareInterruptBase, IdtHardwareInterruptBase + 8);
+        initializePIT(divisor);
+
+        // Interrupts are still disabled, so the PIT is polled.
+        waitForPitReload();
+        auto start = Register::TSC::read();
+        waitForPitReload();
+        tscCyclesPerSecond = (Register::TSC::read() - start) * PitFrequency / divisor;
+    }
+    // The bootstrap processor enables its local APIC when it switches the system over from the PICs.
+    if (LocalApic::isActive()) {
+        LocalApic::enable();
+    }
 }
 
-rlib::OwningPointer<Cpu> Cpu::instance{};
+std::atomic<std::uint32_t> Cpu::count{0};
+std::uint64_t              Cpu::tscCyclesPerSecond = 0;
 
 std::expected<Cpu*, rlib::Error> Cpu::make(rlib::Allocator& allocator, Context& initialContext)
 {
-    if (Cpu::instance != nullptr) {
-        return std::unexpected(AlreadyCreated);
-    }
-
     auto interruptStack = allocator.allocate(InterruptStackSize);
     if (interruptStack == nullptr) {
         return std::unexpected(rlib::OutOfMemoryError);
     }
 
+    // Page faults get a stack of their own: resolving one walks page tables and allocates frames, which does not fit
+    // on the interrupt stack, and it is the only fault the kernel itself is expected to raise.
+    auto pageFaultStack = allocator.allocate(PageFaultStackSize);
+    if (pageFaultStack == nullptr) {
+        return std::unexpected(rlib::OutOfMemoryError);
+    }
+
     auto syscallStack = allocator.allocate(SyscallStackSize);
     if (syscallStack == nullptr) {
         return std::unexpected(rlib::OutOfMemoryError);
     }
 
-    Cpu::instance = rlib::construct<Cpu>(allocator, interruptStack, syscallStack, initialContext);
-    if (Cpu::instance == nullptr) {
+    // Cpus live as long as the system does.
+    auto cpu = rlib::constructRaw<Cpu>(
+        allocator, Cpu::count.fetch_add(1), interruptStack, pageFaultStack, syscallStack, initialContext
+    );
+    if (cpu == nullptr) {
         return std::unexpected(rlib::OutOfMemoryError);
     }
 
-    return Cpu::instance.get();
+    return cpu;
+}
+
+Cpu& Cpu::current()
+{
+    Cpu* cpu;
+    asm volatile("mov %%gs:%c1, %0" : "=r"(cpu) : "i"(offsetof(Core, cpu)));
+
+    return *cpu;
+}
+
+std::uint32_t Cpu::localApicId()
+{
+    std::uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+
+    // Leaf 0BH holds the full x2APIC ID; leaf 01H only its low 8 bits. A leaf 0BH without topology levels reports
+    // zero in EBX.
+    if (eax >= 0xb) {
+        asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0xb), "c"(0));
+        if (ebx != 0) {
+            return edx;
+        }
+    }
+
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+
+    return ebx >> 24;
 }
 
-Cpu& Cpu::getInstance()
+void Cpu::enterAddressSpace(
+    std::uint64_t rootPageTablePhysicalAddress, void* stackTop, void (*entry)(void*), void* argument
+)
 {
-    return *Cpu::instance;
+    ::enterAddressSpace(rootPageTablePhysicalAddress, stackTop, entry, argument);
 }
 
 void Cpu::halt()
@@ -161,11 +249,75 @@ void Cpu::halt()
     asm volatile("hlt");
 }
 
+void Cpu::pause()
+{
+    asm volatile("pause");
+}
+
+void Cpu::enableInterrupts()
+{
+    asm volatile("sti" : : : "memory");
+}
+
+void Cpu::disableInterrupts()
+{
+    asm volatile("cli" : : : "memory");
+}
+
+void Cpu::enableInterruptsAndHalt()
+{
+    // The instruction after sti runs before interrupts are taken.
+    asm volatile("sti; hlt" : : : "memory");
+}
+
+std::uint64_t Cpu::tscFrequency()
+{
+    return tscCyclesPerSecond;
+}
+
+std::uint32_t Cpu::index() const
+{
+    return _index;
+}
+
+std::uint32_t Cpu::apicId() const
+{
+    return _apicId;
+}
+
 void Cpu::setRootPageTable(std::uint64_t rootPageTablePhysicalAddress)
 {
     Register::CR3::write(rootPageTablePhysicalAddress);
 }
 
+void Cpu::invalidatePage(std::uintptr_t address)
+{
+    asm volatile("invlpg (%0)" : : "r"(address) : "memory");
+}
+
+void Cpu::enableGlobalPages()
+{
+    // Toggling PGE flushes the entire TLB.
+    auto cr4 = Register::CR4::read() & ~Register::CR4::PGE;
+    Register::CR4::write(cr4);
+    Register::CR4::write(cr4 | Register::CR4::PGE);
+}
+
+bool Cpu::enablePcid()
+{
+    constexpr auto PcidFeature = std::uint32_t(1) << 17;
+
+    std::uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    if ((ecx & PcidFeature) == 0) {
+        return false;
+    }
+
+    Register::CR4::write(Register::CR4::read() | Register::CR4::PCIDE);
+
+    return true;
+}
+
 void Cpu::registerObserver(CpuObserver& observer)
 {
     this->observer = &observer;
@@ -177,7 +329,7 @@ void Cpu::scheduleContext(Context& context)
     ::switchContext(&context);
 }
 
-void Cpu::setupGdt(void* interruptStack)
+void Cpu::setupGdt(void* interruptStack, void* pageFaultStack)
 {
     constexpr auto DataSegmentAccess = GdtAccess::CodeDataSegment | GdtAccess::Present | GdtAccess::ReadableWritable;
     constexpr auto CodeSegmentAccess = DataSegmentAccess | GdtAccess::Executable;
@@ -185,8 +337,9 @@ void Cpu::setupGdt(void* interruptStack)
 
     // Construct tss
 
-    tss.ist[IstIndex - 1] = reinterpret_cast<std::uintptr_t>(interruptStack) + InterruptStackSize;
-    tss.iobp              = sizeof(TaskStateSegment); // No IOBP
+    tss.ist[IstIndex - 1]          = reinterpret_cast<std::uintptr_t>(interruptStack) + InterruptStackSize;
+    tss.ist[PageFaultIstIndex - 1] = reinterpret_cast<std::uintptr_t>(pageFaultStack) + PageFaultStackSize;
+    tss.iobp                       = sizeof(TaskStateSegment); // No IOBP
 
     gdt[0] = 0;
     // Kernel code segment
@@ -210,6 +363,9 @@ void Cpu::setupIdt()
     idt[8] = makeGateDescriptor(
         reinterpret_cast<uintptr_t>(&doubleFaultHandler), KernelSegmentIndex, GateType::Trap, IstIndex
     );
+    idt[14] = makeGateDescriptor(
+        reinterpret_cast<uintptr_t>(&pageFaultHandler), KernelSegmentIndex, GateType::Interrupt, PageFaultIstIndex
+    );
 
     // Install 16 IRQ handlers
     [this]<std::size_t... Is>(std::index_sequence<Is...>) {
@@ -222,6 +378,14 @@ void Cpu::setupIdt()
          ...);
     }(std::make_index_sequence<16>{});
 
+    // The timer saves the full state of the interrupted thread, so that it can be preempted.
+    idt[IdtHardwareInterruptBase + TimerIrq] = makeGateDescriptor(
+        reinterpret_cast<uintptr_t>(&timerInterruptThunk), KernelSegmentIndex, GateType::Interrupt, IstIndex
+    );
+    idt[LocalApic::SpuriousVector] = makeGateDescriptor(
+        reinterpret_cast<uintptr_t>(&spuriousInterruptHandler), KernelSegmentIndex, GateType::Interrupt, IstIndex
+    );
+
     setIdt(sizeof(idt), idt);
 }
 
@@ -229,6 +393,7 @@ void Cpu::setupSyscall(void* syscallStack, Context& initialContext)
 {
     core.kernelStack   = reinterpret_cast<std::uintptr_t>(syscallStack) + SyscallStackSize;
     core.activeContext = &initialContext;
+    core.cpu           = this;
 
     setupSyscallHandler(KernelSegmentIndex, UserSegmentIndex, &core);
 }
@@ -252,7 +417,7 @@ void Register::CR3::write(std::uint64_t value)
                  "mov %%rax, %%cr3"
                  :
                  : "m"(value)
-                 : "%rax");
+                 : "%rax", "memory");
 };
 
 void Register::CR3::flushTLBS()
@@ -264,9 +429,62 @@ void Register::CR3::flushTLBS()
                  : "%rax");
 };
 
+std::uint64_t Register::CR2::read()
+{
+    std::uint64_t cr2;
+
+    asm volatile("mov %%cr2, %0" : "=r"(cr2));
+
+    return cr2;
+}
+
+std::uint64_t Register::CR4::read()
+{
+    std::uint64_t cr4;
+
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+
+    return cr4;
+}
+
+void Register::CR4::write(std::uint64_t value)
+{
+    asm volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+void Register::CR4::flushTLBS()
+{
+    auto cr4 = read();
+    write(cr4 ^ PGE);
+    write(cr4);
+}
+
+std::uint64_t Register::TSC::read()
+{
+    std::uint32_t low, high;
+
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+
+    return (std::uint64_t(high) << 32) | low;
+}
+
+std::uint64_t Register::MSR::read(std::uint32_t msr)
+{
+    std::uint32_t low, high;
+
+    asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+
+    return (std::uint64_t(high) << 32) | low;
+}
+
+void Register::MSR::write(std::uint32_t msr, std::uint64_t value)
+{
+    asm volatile("wrmsr" : : "c"(msr), "a"(std::uint32_t(value)), "d"(std::uint32_t(value >> 32)) : "memory");
+}
+
 extern "C" Context* systemCallHandler()
 {
-    auto& cpu = Cpu::getInstance();
+    auto& cpu = Cpu::current();
 
     if (cpu.observer == nullptr) {
         return cpu.core.activeContext;
@@ -274,3 +492,15 @@ extern "C" Context* systemCallHandler()
 
     return &cpu.observer->onSyscall(*cpu.core.activeContext);
 }
+
+extern "C" Context* timerInterruptHandler(bool userMode)
+{
+    auto& cpu = Cpu::current();
+    endOfInterrupt(Cpu::TimerIrq);
+
+    if (cpu.observer == nullptr) {
+        return cpu.core.activeContext;
+    }
+
+    return &cpu.observer->onTimer(*cpu.core.activeContext, userMode);
+}
@@ -0,0 +1,113 @@
+#include "kernel/heap.hpp"
+#include <algorithm>
+
+std::expected<KernelHeap, rlib::Error>
+KernelHeap::make(AddressSpace& addressSpace, std::size_t size, PageFlags::Type flags)
+{
+    if (size % ChunkSize != 0 || size / ChunkSize > MaxChunks) {
+        return std::unexpected(OutOfBounds);
+    }
+
+    // Transparent huge page regions are aligned to 2 MiB, so chunks can be mapped with a single page each.
+    auto window = addressSpace.reserve(size, flags, PageSize::_4KiB, RegionFlags::TransparentHugePages);
+    if (!window) {
+        return std::unexpected(window.error());
+    }
+
+    return KernelHeap(**window);
+}
+
+KernelHeap::KernelHeap(Region& window) :
+    window(&window),
+    numberOfChunks(window.size() / ChunkSize),
+    chunks{},
+    current{},
+    offset(0)
+{}
+
+std::optional<std::size_t> KernelHeap::findFreeChunks(std::size_t count) const
+{
+    auto run = std::size_t(0);
+    for (auto chunk = std::size_t(0); chunk < numberOfChunks; chunk++) {
+        run = chunks[chunk].committed ? 0 : run + 1;
+        if (run == count) {
+            return chunk + 1 - count;
+        }
+    }
+
+    return {};
+}
+
+void KernelHeap::decommit(std::size_t chunk)
+{
+    window->decommit(chunk * ChunkSize, ChunkSize);
+    chunks[chunk].committed = false;
+}
+
+std::size_t KernelHeap::chunkOf(void* p) const
+{
+    return (VirtualAddress(p) - window->start()) / ChunkSize;
+}
+
+void* KernelHeap::do_allocate(std::size_t bytes, std::size_t alignment)
+{
+    if (alignment > ChunkSize) {
+        return nullptr;
+    }
+
+    auto aligned = (offset + alignment - 1) & ~(alignment - 1);
+    if (current && aligned + bytes <= ChunkSize) {
+        chunks[*current].allocations++;
+        offset = aligned + bytes;
+        return VirtualAddress(window->start() + *current * ChunkSize + aligned).ptr();
+    }
+
+    // Start afresh at a chunk boundary, which satisfies any alignment.
+    auto count = std::max<std::size_t>((bytes + ChunkSize - 1) / ChunkSize, 1);
+    auto first = findFreeChunks(count);
+    if (!first) {
+        return nullptr;
+    }
+    auto error = window->commit(*first * ChunkSize, count * ChunkSize);
+    if (error) {
+        window->decommit(*first * ChunkSize, count * ChunkSize);
+        return nullptr;
+    }
+    for (auto chunk = *first; chunk < *first + count; chunk++) {
+        chunks[chunk] = Chunk{1, true};
+    }
+
+    // Only a chunk with room to spare becomes current.
+    if (count == 1) {
+        if (current && chunks[*current].allocations == 0) {
+            decommit(*current);
+        }
+        current = *first;
+        offset  = bytes;
+    }
+
+    return VirtualAddress(window->start() + *first * ChunkSize).ptr();
+}
+
+void KernelHeap::do_deallocate(void* p, std::size_t bytes, std::size_t)
+{
+    auto first = chunkOf(p);
+    auto last  = chunkOf(static_cast<std::byte*>(p) + std::max<std::size_t>(bytes, 1) - 1);
+    for (auto chunk = first; chunk <= last; chunk++) {
+        if (--chunks[chunk].allocations > 0) {
+            continue;
+        }
+
+        if (chunk == current) {
+            // Reuse the current chunk from the start.
+            offset = 0;
+        } else {
+            decommit(chunk);
+        }
+    }
+}
+
+bool KernelHeap::do_owns(void* p) const
+{
+    return window->contains(p);
+}
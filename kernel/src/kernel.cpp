@@ -1,7 +1,10 @@
 #include "kernel/kernel.hpp"
 #include "kernel/paging.hpp"
+#include "kernel/slab.hpp"
+#include "kernel/heap.hpp"
 #include <kernel/panic.hpp>
 #include <libr/ustar.hpp>
+#include <libr/size_class_allocator.hpp>
 #include <libr/pointer.hpp>
 
 using namespace rlib;
@@ -43,7 +46,9 @@ std::expected<Thread*, Error> Thread::make(
         return std::unexpected(OutOfMemoryError);
     }
 
-    auto ipcBuffer = kernelAddressSpace.allocate(4_KiB, PageFlags::Present | PageFlags::Writable, PageSize::_4KiB);
+    auto ipcBuffer = kernelAddressSpace.allocate(
+        4_KiB, PageFlags::Present | PageFlags::Writable | PageFlags::Global, PageSize::_4KiB
+    );
     if (!ipcBuffer) {
         return std::unexpected(OutOfPhysicalMemory);
     }
@@ -58,23 +63,54 @@ std::expected<Thread*, Error> Thread::make(
     return threadPtr;
 }
 
+std::expected<Processor*, Error> Processor::make(Allocator& allocator, Thread& idleThread)
+{
+    auto scheduler = Scheduler::make(allocator);
+    if (!scheduler) {
+        return std::unexpected(scheduler.error());
+    }
+
+    auto processor = constructRaw<Processor>(allocator, idleThread, std::move(*scheduler));
+    if (processor == nullptr) {
+        return std::unexpected(OutOfMemoryError);
+    }
+
+    return processor;
+}
+
+Processor::Processor(Thread& idleThread, Scheduler scheduler) :
+    idleThread(&idleThread), scheduler(std::move(scheduler))
+{
+    idleThread.processor = this;
+    idleThread.pinned    = true;
+}
 
-std::expected<Kernel, Error>
-Kernel::make(MemoryLayout memoryLayout, std::byte* initialHeapStorage, TableView rootPageTable)
+
+std::expected<Kernel, Error> Kernel::make(
+    MemoryLayout memoryLayout, std::size_t numberOfProcessors, std::byte* initialHeapStorage, TableView rootPageTable
+)
 {
     // A stable reference to initialAllocator is required for construction the kernel address space (in theory; in practice, the kernel address space is never deallocated).
     // Assume initialHeapStorage is aligned for BumpAllocator.
     auto initialAllocator = ::new (initialHeapStorage)
         BumpAllocator(initialHeapStorage + sizeof(BumpAllocator), IntialHeapSize - sizeof(BumpAllocator));
+    auto timings = BootTimings{};
+    auto start   = Register::TSC::read();
+
     auto pageFrameAllocator = PageFrameAllocator::make(
         *memoryLayout.freeMemoryBlocks, memoryLayout.identityMapping, 4_KiB, *initialAllocator
     );
+    if (!pageFrameAllocator) {
+        return std::unexpected(pageFrameAllocator.error());
+    }
+    timings.frameAllocator = Register::TSC::read() - start;
     auto pageMapper =
         constructRaw<PageMapper>(*initialAllocator, memoryLayout.identityMapping, std::move(*pageFrameAllocator));
     if (pageMapper == nullptr) {
         return std::unexpected(OutOfPhysicalMemory);
     }
 
+    start = Register::TSC::read();
     auto kernelAddressSpace =
         AddressSpace::make(*pageMapper, *initialAllocator, StartKernelSpace, EndKernelSpace - StartKernelSpace + 1);
     if (!kernelAddressSpace) {
@@ -85,25 +121,45 @@ Kernel::make(MemoryLayout memoryLayout, std::byte* initialHeapStorage, TableView
         return std::unexpected(*error);
     }
     Cpu::setRootPageTable((*kernelAddressSpace)->rootTablePhysicalAddress());
+    Cpu::enableGlobalPages();
+    timings.kernelAddressSpace = Register::TSC::read() - start;
 
-    // map kernel heap
-    constexpr auto heapFlags  = PageFlags::Present | PageFlags::Writable | PageFlags::NoExecute;
-    auto           heapRegion = (*kernelAddressSpace)->allocate(KernelHeapSize, heapFlags, PageSize::_4KiB);
-    if (!heapRegion) {
-        return std::unexpected(heapRegion.error());
+    // Reserve the kernel heap; it is backed by memory as it grows.
+    constexpr auto heapFlags  = PageFlags::Present | PageFlags::Writable | PageFlags::NoExecute | PageFlags::Global;
+    auto           kernelHeap = KernelHeap::make(**kernelAddressSpace, KernelHeapSize, heapFlags);
+    if (!kernelHeap) {
+        return std::unexpected(kernelHeap.error());
     }
 
-    // Wrap construction of allocator to infer its type
-    auto makeFallbackAllocator = [=](void* storage) mutable -> auto {
-        auto stackAllocator = BumpAllocator((*heapRegion)->start().ptr(), (*heapRegion)->size());
-        return ::new (storage) FallbackAllocator(RefAllocator(*initialAllocator), std::move(stackAllocator));
-    };
+    // Small objects come from slabs, larger ones from size classes in the kernel heap.
+    auto slabAllocator = SlabAllocator::make(*pageMapper, *initialAllocator);
+    if (!slabAllocator) {
+        return std::unexpected(slabAllocator.error());
+    }
+    auto heapAllocator = SizeClassAllocator<KernelHeap>::make(std::move(*kernelHeap), *initialAllocator);
+    if (!heapAllocator) {
+        return std::unexpected(heapAllocator.error());
+    }
+
+    // Wrap construction of allocator to infer its type. Every link keeps statistics of the requests it serves.
+    auto makeFallbackAllocator =
+        [=, slabs = std::move(*slabAllocator), heap = std::move(*heapAllocator)](void* storage) mutable -> auto {
+            auto fallback = FallbackAllocator(
+                StatsAllocator(std::move(heap)), StatsAllocator(RefAllocator(*initialAllocator))
+            );
+            return ::new (storage) FallbackAllocator(StatsAllocator(std::move(slabs)), std::move(fallback));
+        };
     using AllocatorType   = std::remove_pointer_t<decltype(makeFallbackAllocator(std::declval<void*>()))>;
     auto allocatorStorage = initialAllocator->allocate(sizeof(AllocatorType), alignof(AllocatorType));
     if (allocatorStorage == nullptr) {
         return std::unexpected(OutOfPhysicalMemory);
     }
-    auto allocator = makeFallbackAllocator(allocatorStorage);
+    auto allocator      = makeFallbackAllocator(allocatorStorage);
+    auto heapStatistics = HeapStatistics{
+        &allocator->primaryAllocator().stats(),
+        &allocator->secondaryAllocator().primaryAllocator().stats(),
+        &allocator->secondaryAllocator().secondaryAllocator().stats(),
+    };
 
     auto mailbox = mpmcBoundedQueue<Message>::make(Thread::MessageBufferSize, *allocator);
     if (mailbox == nullptr) {
@@ -114,10 +170,49 @@ Kernel::make(MemoryLayout memoryLayout, std::byte* initialHeapStorage, TableView
         return std::unexpected(OutOfPhysicalMemory);
     }
 
+    auto bootstrapProcessor = Processor::make(*allocator, *kernelThread);
+    if (!bootstrapProcessor) {
+        return std::unexpected(bootstrapProcessor.error());
+    }
     auto cpu = Cpu::make(*allocator, kernelThread->context);
     if (!cpu) {
         return std::unexpected(cpu.error());
     }
+    (*bootstrapProcessor)->cpu = *cpu;
+
+    // Interrupts go through the APICs when the firmware describes them, and through the PICs otherwise.
+    auto interruptRouter = std::optional<InterruptRouter>();
+    if (auto madt = parseMadt(memoryLayout.identityMapping, memoryLayout.acpiPhysicalAddress); madt) {
+        auto router = InterruptRouter::make(*madt, *kernelThread->addressSpace);
+        if (!router) {
+            return std::unexpected(router.error());
+        }
+        // The local APIC timers take over from the PIT, whose interrupt stays masked.
+        auto timerVector = Cpu::IdtHardwareInterruptBase + Cpu::TimerIrq;
+        auto error       = LocalApic::initialize(*kernelThread->addressSpace, madt->localApicAddress, timerVector);
+        if (error) {
+            return std::unexpected(*error);
+        }
+
+        // The keyboard goes to the bootstrap processor, as it did through the PICs.
+        error = router->route(KeyboardIrq, Cpu::IdtHardwareInterruptBase + KeyboardIrq, (*cpu)->apicId());
+        if (error) {
+            return std::unexpected(*error);
+        }
+        interruptRouter = std::move(*router);
+    }
+
+    // Application processors start in the page tables of the boot loader, which do not map the kernel heap, so their
+    // stacks are set aside up front. Processors beyond MaxProcessors are left parked.
+    auto processorStacksSize = (std::clamp(numberOfProcessors, std::size_t(1), MaxProcessors) - 1) * ProcessorStackSize;
+    auto processorStacks     = std::span<std::byte>();
+    if (processorStacksSize > 0) {
+        auto stacks = static_cast<std::byte*>(allocator->allocate(processorStacksSize));
+        if (stacks == nullptr) {
+            return std::unexpected(OutOfMemoryError);
+        }
+        processorStacks = std::span(stacks, processorStacksSize);
+    }
 
     auto initrdStart  = memoryLayout.identityMapping.translate(memoryLayout.initrdPhysicalAddress);
     auto memorySource = MemorySource(initrdStart.ptr<std::byte>(), memoryLayout.initrdSize);
@@ -133,11 +228,15 @@ Kernel::make(MemoryLayout memoryLayout, std::byte* initialHeapStorage, TableView
         std::in_place,
         kernelThread,
         pageMapper,
-        **cpu,
+        **bootstrapProcessor,
+        processorStacks,
+        std::move(interruptRouter),
         allocator,
         std::move(inputStream),
         std::move(*threadList),
-        memoryLayout.framebufferStart
+        memoryLayout.framebufferStart,
+        timings,
+        heapStatistics
     );
 }
 
@@ -145,8 +244,15 @@ std::optional<Error> Kernel::setupKernelAddressSpace(
     AddressSpace& addressSpace, TableView rootPageTable, MemoryLayout memoryLayout, PageMapper& pageMapper
 )
 {
+    // The boot loader's tables and ours are walked page by page below; keep the resolved tables around.
+    auto bootTables   = PageTableCursor(pageMapper, rootPageTable);
+    auto kernelTables = addressSpace.cursor();
+
+    // The kernel half is shared by every address space; keep its TLB entries across CR3 reloads.
+    constexpr auto kernelFlags = PageFlags::Present | PageFlags::Global;
+
     // identity map total physical memory
-    constexpr auto identityFlags     = PageFlags::Present | PageFlags::Writable | PageFlags::NoExecute;
+    constexpr auto identityFlags     = kernelFlags | PageFlags::Writable | PageFlags::NoExecute;
     auto           identityMapRegion = addressSpace.reserve(
         memoryLayout.identityMapping.translate(0), memoryLayout.totalPhysicalMemory, identityFlags, PageSize::_1GiB
     );
@@ -155,14 +261,14 @@ std::optional<Error> Kernel::setupKernelAddressSpace(
     }
     for (auto physicalAddress = std::uint64_t(0); physicalAddress < memoryLayout.totalPhysicalMemory;
          physicalAddress += 1_GiB) {
-        auto error = (*identityMapRegion)->mapPage(physicalAddress, physicalAddress / 1_GiB);
+        auto error = (*identityMapRegion)->mapPage(kernelTables, physicalAddress, physicalAddress / 1_GiB);
         if (error) {
             return *error;
         }
     }
 
     // map kernel code and read-only data
-    constexpr auto kernelCodeFlags  = PageFlags::Present;
+    constexpr auto kernelCodeFlags  = kernelFlags;
     auto           kernelCodeRegion = addressSpace.reserve(
         memoryLayout.kernelCodeStart,
         memoryLayout.kernelWritableDataStart - memoryLayout.kernelCodeStart,
@@ -173,15 +279,15 @@ std::optional<Error> Kernel::setupKernelAddressSpace(
         return kernelCodeRegion.error();
     }
     for (auto frame = std::size_t(0); frame < (*kernelCodeRegion)->sizeInFrames(); frame++) {
-        auto physicalKernelCodePageEntry = pageMapper.read(rootPageTable, memoryLayout.kernelCodeStart + frame * 4_KiB);
+        auto physicalKernelCodePageEntry = bootTables.read(memoryLayout.kernelCodeStart + frame * 4_KiB);
         if (!physicalKernelCodePageEntry) {
             return UnexpectedMemoryLayout;
         }
-        (*kernelCodeRegion)->mapPage(*physicalKernelCodePageEntry, frame);
+        (*kernelCodeRegion)->mapPage(kernelTables, *physicalKernelCodePageEntry, frame);
     }
 
     // map kernel data as non-executable
-    constexpr auto kernelDataFlags  = PageFlags::Present | PageFlags::Writable | PageFlags::NoExecute;
+    constexpr auto kernelDataFlags  = kernelFlags | PageFlags::Writable | PageFlags::NoExecute;
     auto           kernelDataRegion = addressSpace.reserve(
         memoryLayout.kernelWritableDataStart,
         memoryLayout.kernelWritableDataEnd - memoryLayout.kernelWritableDataStart,
@@ -192,12 +298,11 @@ std::optional<Error> Kernel::setupKernelAddressSpace(
         return kernelDataRegion.error();
     }
     for (auto frame = std::size_t(0); frame < (*kernelDataRegion)->sizeInFrames(); frame++) {
-        auto physicalKernelDataPageEntry =
-            pageMapper.read(rootPageTable, memoryLayout.kernelWritableDataStart + frame * 4_KiB);
+        auto physicalKernelDataPageEntry = bootTables.read(memoryLayout.kernelWritableDataStart + frame * 4_KiB);
         if (!physicalKernelDataPageEntry) {
             return UnexpectedMemoryLayout;
         }
-        (*kernelDataRegion)->mapPage(*physicalKernelDataPageEntry, frame);
+        (*kernelDataRegion)->mapPage(kernelTables, *physicalKernelDataPageEntry, frame);
     }
 
     // map kernel stack
@@ -215,15 +320,15 @@ std::optional<Error> Kernel::setupKernelAddressSpace(
         }
     }
     for (; frame < (*kernelStackRegion)->sizeInFrames(); frame++) {
-        auto physicalKernelStackPageEntry = pageMapper.read(rootPageTable, kernelStackBottom + frame * 4_KiB);
+        auto physicalKernelStackPageEntry = bootTables.read(kernelStackBottom + frame * 4_KiB);
         if (!physicalKernelStackPageEntry) {
             return UnexpectedMemoryLayout;
         }
-        (*kernelStackRegion)->mapPage(*physicalKernelStackPageEntry, frame);
+        (*kernelStackRegion)->mapPage(kernelTables, *physicalKernelStackPageEntry, frame);
     }
 
     // map framebuffer
-    constexpr auto framebufferFlags  = PageFlags::Present | PageFlags::Writable | PageFlags::NoExecute;
+    constexpr auto framebufferFlags  = kernelFlags | PageFlags::Writable | PageFlags::NoExecute;
     auto           framebufferRegion = addressSpace.reserve(
         memoryLayout.framebufferStart, memoryLayout.framebufferSize, framebufferFlags, PageSize::_2MiB
     );
@@ -231,12 +336,11 @@ std::optional<Error> Kernel::setupKernelAddressSpace(
         return framebufferRegion.error();
     }
     for (auto frame = std::size_t(0); frame < (*framebufferRegion)->sizeInFrames(); frame++) {
-        auto physicalFramebufferPageEntry =
-            pageMapper.read(rootPageTable, memoryLayout.framebufferStart + frame * 2_MiB);
+        auto physicalFramebufferPageEntry = bootTables.read(memoryLayout.framebufferStart + frame * 2_MiB);
         if (!physicalFramebufferPageEntry) {
             return UnexpectedMemoryLayout;
         }
-        (*framebufferRegion)->mapPage(*physicalFramebufferPageEntry, frame);
+        (*framebufferRegion)->mapPage(kernelTables, *physicalFramebufferPageEntry, frame);
     }
 
     return {};
@@ -244,17 +348,35 @@ std::optional<Error> Kernel::setupKernelAddressSpace(
 
 
 Kernel::Kernel(
-    Thread*                   kernelThread,
-    PageMapper*               pageMapper,
-    Cpu&                      cpu,
-    Allocator*                allocator,
-    InputStream<MemorySource> initrd,
-    ThreadList                threads,
-    std::uint32_t*            framebuffer
+    Thread*                        kernelThread,
+    PageMapper*                    pageMapper,
+    Processor&                     bootstrapProcessor,
+    std::span<std::byte>           processorStacks,
+    std::optional<InterruptRouter> interruptRouter,
+    Allocator*                     allocator,
+    InputStream<MemorySource>      initrd,
+    ThreadList                     threads,
+    std::uint32_t*                 framebuffer,
+    BootTimings                    bootTimings,
+    HeapStatistics                 heapStatistics
 ) :
-    pageMapper(pageMapper), cpu(&cpu), allocator(allocator), threads(std::move(threads)), framebuffer(framebuffer)
+    pageMapper(pageMapper),
+    cpu(bootstrapProcessor.cpu),
+    allocator(allocator),
+    processorStacks(processorStacks),
+    interruptRouter(std::move(interruptRouter)),
+    kernelRootTable(kernelThread->addressSpace->rootTablePhysicalAddress()),
+    threads(std::move(threads)),
+    framebuffer(framebuffer),
+    timings(bootTimings),
+    heapStats(heapStatistics)
 {
     this->threads.pushFront(*kernelThread);
+    addProcessor(bootstrapProcessor);
+
+    if (Cpu::enablePcid()) {
+        pcids.enable();
+    }
 
     auto elfStream = UStar::lookup(initrd, "serial.elf"_sv);
     if (!elfStream) {
@@ -270,26 +392,392 @@ Kernel::Kernel(
 
 void Kernel::run()
 {
-    HardwareInterrupt interruptBuffer[InterruptBufferSize];
+    HardwareInterrupt interruptBuffer[Processor::InterruptBufferSize];
     cpu->registerObserver(*this);
-    scheduleThread(*service);
+    setPanicObserver(*this);
+    TlbGather::setShootdown(*this);
 
+    auto& processor     = currentProcessor();
+    auto  lastRebalance = std::uint64_t(0);
     while (true) {
-        auto interruptEnd = interrupts.dequeueAll(interruptBuffer);
-        // Process Interrupts.
-        for (auto interrupt = interruptBuffer; interrupt != interruptEnd; interrupt++) {
-            // Remove this when keyboard driver is implemented.
-            if (interrupt->IRQ == 1) {
-                panic("Key pressed");
+        {
+            auto guard = lockKernel(processor);
+
+            // Process Interrupts.
+            for (const auto& slot : processors) {
+                auto other = slot.load(std::memory_order_acquire);
+                if (other == nullptr) {
+                    continue;
+                }
+                auto interruptEnd = other->interrupts.dequeueAll(interruptBuffer);
+                for (auto interrupt = interruptBuffer; interrupt != interruptEnd; interrupt++) {
+                    // Remove this when keyboard driver is implemented.
+                    if (interrupt->IRQ == KeyboardIrq) {
+                        panic("Key pressed");
+                    }
+                }
+            }
+
+            std::optional<Message> message;
+            while ((message = kernelThread()->mailbox->dequeue())) {
+                // Every message is a kill-thread message
+                killThread(*allocator, message->senderId);
+            }
+        }
+
+        if (Register::TSC::read() - lastRebalance >= RebalanceInterval * Cpu::tscFrequency() / 1000) {
+            rebalance();
+            lastRebalance = Register::TSC::read();
+        }
+
+        // Give the ready threads their turn. The kernel thread runs again after them, or on the next system call.
+        auto next = pickNext(processor);
+        if (next == nullptr) {
+            waitForWork(processor);
+        } else {
+            makeReady(processor, *kernelThread());
+            scheduleThread(*next);
+        }
+    }
+}
+
+void Kernel::startProcessor()
+{
+    // The page tables of the boot loader map the kernel image and this object, which lives on the boot stack of the
+    // bootstrap processor, but not the kernel heap.
+    auto index = startedProcessors.fetch_add(1, std::memory_order_relaxed);
+    if ((index + 1) * ProcessorStackSize > processorStacks.size()) {
+        while (true) {
+            Cpu::halt();
+        }
+    }
+
+    auto stackTop = processorStacks.data() + (index + 1) * ProcessorStackSize;
+    Cpu::enterAddressSpace(
+        kernelRootTable, stackTop, [](void* kernel) { static_cast<Kernel*>(kernel)->runProcessor(); }, this
+    );
+}
+
+void Kernel::runProcessor()
+{
+    Cpu::enableGlobalPages();
+    // Contexts carry the PCID of their address space, which cannot be loaded unless PCIDs are enabled.
+    if (pcids.isEnabled() && !Cpu::enablePcid()) {
+        panic("Processor does not support PCIDs");
+    }
+
+    auto processor = static_cast<Processor*>(nullptr);
+    {
+        auto guard = LockGuard(lock);
+        // The idle thread runs in whichever address space is loaded, and has no mailbox.
+        auto idleThread = constructRaw<Thread>(
+            *allocator,
+            Context{},
+            OwningPointer<AddressSpace>(),
+            OwningPointer<mpmcBoundedQueue<Message>>(),
+            nullptr,
+            nullptr
+        );
+        if (idleThread == nullptr) {
+            panic("Cannot start processor");
+        }
+        auto newProcessor = Processor::make(*allocator, *idleThread);
+        if (!newProcessor) {
+            panic("Cannot start processor");
+        }
+        processor = *newProcessor;
+        auto cpu  = Cpu::make(*allocator, idleThread->context);
+        if (!cpu) {
+            panic("Cannot start processor");
+        }
+        processor->cpu = *cpu;
+        addProcessor(*processor);
+        // Shootdowns wait for the processor from now on, but not for the flushes it may have missed before.
+        catchUp(*processor);
+    }
+
+    // Run ready threads, and look for threads to steal in between.
+    processor->cpu->registerObserver(*this);
+    while (true) {
+        auto next = pickNext(*processor);
+        if (next == nullptr) {
+            waitForWork(*processor);
+        } else {
+            scheduleThread(*next);
+        }
+    }
+}
+
+void Kernel::addProcessor(Processor& processor)
+{
+    // Indices stay below MaxProcessors, as no more processors get a stack.
+    processors[processor.cpu->index()].store(&processor, std::memory_order_release);
+}
+
+Processor& Kernel::currentProcessor() const
+{
+    return *processors[Cpu::current().index()].load(std::memory_order_relaxed);
+}
+
+void Kernel::catchUp(Processor& processor)
+{
+    // Changes to the kernel half are only invalidated on the processor which makes them.
+    auto globalFlushes = TlbGather::globalFlushes();
+    if (processor.globalFlushes.load(std::memory_order_relaxed) != globalFlushes) {
+        Register::CR4::flushTLBS();
+        processor.globalFlushes.store(globalFlushes, std::memory_order_release);
+    }
+}
+
+LockGuard<SpinLock> Kernel::lockKernel(Processor& processor)
+{
+    while (!lock.tryLock()) {
+        catchUp(processor);
+        Cpu::pause();
+    }
+
+    return LockGuard(lock, adoptLock);
+}
+
+void Kernel::shootdown(std::uint64_t globalFlushes)
+{
+    // Without local APICs, application processors cannot be interrupted. They catch up when they next switch threads.
+    if (!LocalApic::isActive()) {
+        return;
+    }
+
+    // The calling processor has no Cpu to find it by while it starts, and is not registered then.
+    auto self   = static_cast<Processor*>(nullptr);
+    auto apicId = Cpu::localApicId();
+    for (const auto& slot : processors) {
+        auto other = slot.load(std::memory_order_acquire);
+        if (other != nullptr && other->cpu->apicId() == apicId) {
+            self = other;
+        }
+    }
+
+    // The caller invalidated its own entries. Unless it missed an earlier flush, it is up to date.
+    if (self != nullptr && self->globalFlushes.load(std::memory_order_relaxed) == globalFlushes - 1) {
+        self->globalFlushes.store(globalFlushes, std::memory_order_release);
+    }
+
+    // Processors registered later catch up as they register.
+    static_assert(MaxProcessors <= 64);
+    auto targets = std::uint64_t(0);
+    for (auto i = std::size_t(0); i < processors.size(); i++) {
+        auto other = processors[i].load(std::memory_order_acquire);
+        if (other != nullptr && other != self && other->globalFlushes.load(std::memory_order_acquire) < globalFlushes) {
+            targets |= std::uint64_t(1) << i;
+            wake(*other);
+        }
+    }
+
+    // The targets catch up in onTimer, or while they wait for the lock. Another processor may shoot down at the same
+    // time and wait for this one in turn.
+    for (auto i = std::size_t(0); i < processors.size(); i++) {
+        if ((targets & (std::uint64_t(1) << i)) == 0) {
+            continue;
+        }
+        auto& other = *processors[i].load(std::memory_order_acquire);
+        while (other.globalFlushes.load(std::memory_order_acquire) < globalFlushes) {
+            if (self != nullptr) {
+                catchUp(*self);
+            }
+            Cpu::pause();
+        }
+    }
+}
+
+void Kernel::makeReady(Processor& processor, Thread& thread)
+{
+    // Set before the thread is visible to other processors.
+    thread.processor = &processor;
+    processor.scheduler.enqueue(thread);
+
+    // Another processor may be halted, or run a thread without a deadline as nothing competed with it.
+    if (&processor != &currentProcessor()) {
+        wake(processor);
+    }
+
+    // Pairs with the fence in waitForWork: either a halting processor sees the thread, or it is seen halted here.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (thread.pinned) {
+        return;
+    }
+    for (const auto& slot : processors) {
+        auto other = slot.load(std::memory_order_acquire);
+        if (other != nullptr && other != &processor && other->halted.load(std::memory_order_relaxed)) {
+            wake(*other);
+            break;
+        }
+    }
+}
+
+void Kernel::wake(Processor& processor)
+{
+    if (LocalApic::isActive()) {
+        LocalApic::sendIpi(processor.cpu->apicId(), Cpu::IdtHardwareInterruptBase + Cpu::TimerIrq);
+    }
+}
+
+void Kernel::waitForWork(Processor& processor)
+{
+    // The bootstrap processor is woken by the PIT when there are no local APICs.
+    if (!LocalApic::isActive() && &processor != kernelThread()->processor) {
+        Cpu::pause();
+        return;
+    }
+
+    // An interrupt between the check and the halt would go unnoticed until the next one. The kernel thread also has
+    // messages and interrupts to handle, which may have arrived after it last looked.
+    Cpu::disableInterrupts();
+    processor.halted.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto kernelWork = &processor == kernelThread()->processor && kernelWorkPending();
+    if (processor.scheduler.size() == 0 && !kernelWork) {
+        if (LocalApic::isActive()) {
+            auto stealable = false;
+            for (const auto& slot : processors) {
+                auto other = slot.load(std::memory_order_acquire);
+                stealable |= other != nullptr && other != &processor && other->scheduler.stealableSize() > 0;
+            }
+            if (stealable) {
+                LocalApic::setDeadline(Register::TSC::read() + Scheduler::CacheHotCycles);
+            } else {
+                LocalApic::clearDeadline();
             }
         }
 
-        std::optional<Message> message;
-        while ((message = kernelThread()->mailbox->dequeue())) {
-            // Every message is a kill-thread message
-            killThread(*allocator, message->senderId);
+        auto start = Register::TSC::read();
+        Cpu::enableInterruptsAndHalt();
+        processor.scheduler.idle(Register::TSC::read() - start);
+    }
+    processor.halted.store(false, std::memory_order_relaxed);
+    Cpu::enableInterrupts();
+}
+
+bool Kernel::kernelWorkPending() const
+{
+    if (!kernelThread()->mailbox->empty()) {
+        return true;
+    }
+
+    for (const auto& slot : processors) {
+        auto processor = slot.load(std::memory_order_acquire);
+        if (processor != nullptr && !processor->interrupts.empty()) {
+            return true;
         }
     }
+
+    return false;
+}
+
+void Kernel::armTimer(Processor& processor, const Thread& thread)
+{
+    // Without local APICs, the PIT ticks at a fixed rate instead.
+    if (!LocalApic::isActive()) {
+        return;
+    }
+
+    auto kernelMode = (thread.context.flags & Context::Flags::KernelMode) != 0;
+    if (kernelMode || processor.scheduler.size() == 0) {
+        LocalApic::clearDeadline();
+    } else {
+        LocalApic::setDeadline(processor.scheduler.sliceEnd());
+    }
+}
+
+Thread* Kernel::pickNext(Processor& processor)
+{
+    if (auto thread = processor.scheduler.dequeue(); thread != nullptr) {
+        return thread;
+    }
+
+    auto victim = static_cast<Processor*>(nullptr);
+    for (const auto& slot : processors) {
+        auto other = slot.load(std::memory_order_acquire);
+        if (other != nullptr && other != &processor && other->scheduler.size() > 0 &&
+            (victim == nullptr || other->scheduler.size() > victim->scheduler.size())) {
+            victim = other;
+        }
+    }
+
+    return victim != nullptr ? victim->scheduler.steal() : nullptr;
+}
+
+void Kernel::rebalance()
+{
+    auto busiest   = static_cast<Processor*>(nullptr);
+    auto leastBusy = static_cast<Processor*>(nullptr);
+    for (const auto& slot : processors) {
+        auto processor = slot.load(std::memory_order_acquire);
+        if (processor == nullptr) {
+            continue;
+        }
+        if (busiest == nullptr || processor->scheduler.size() > busiest->scheduler.size()) {
+            busiest = processor;
+        }
+        if (leastBusy == nullptr || processor->scheduler.size() < leastBusy->scheduler.size()) {
+            leastBusy = processor;
+        }
+    }
+
+    while (busiest != leastBusy && busiest->scheduler.size() > leastBusy->scheduler.size() + 1) {
+        auto thread = busiest->scheduler.migrate();
+        if (thread == nullptr) {
+            break;
+        }
+        makeReady(*leastBusy, *thread);
+    }
+}
+
+const BootTimings& Kernel::bootTimings() const
+{
+    return timings;
+}
+
+const HeapStatistics& Kernel::heapStatistics() const
+{
+    return heapStats;
+}
+
+void Kernel::onPanic(PanicWriter& writer)
+{
+    auto print = [&](const char* name, const AllocatorStats& stats) {
+        writer << name << ": allocations " << stats.allocations << ", frees " << stats.deallocations << ", declined "
+               << stats.declinedAllocations << ", live " << stats.liveBytes << " B, peak " << stats.peakBytes << " B";
+        writer.newLine();
+        writer << "  sizes below 2^n:";
+        for (auto bucket = std::size_t(0); bucket < AllocatorStats::HistogramBuckets; bucket++) {
+            if (stats.sizeHistogram[bucket] != 0) {
+                writer << " " << std::uint64_t(bucket) << ":" << stats.sizeHistogram[bucket];
+            }
+        }
+        writer.newLine();
+    };
+
+    writer << "boot: frame allocator " << timings.frameAllocator << " cycles, kernel address space "
+           << timings.kernelAddressSpace << " cycles, unused memory " << pageMapper->unusedMemory() << " B";
+    writer.newLine();
+
+    print("slabs", *heapStats.slabs);
+    print("size classes", *heapStats.sizeClasses);
+    print("bootstrap", *heapStats.bootstrap);
+    // Requests only reach the last link when the others declined them.
+    writer << "heap: failed " << heapStats.bootstrap->declinedAllocations;
+    writer.newLine();
+
+    for (const auto& slot : processors) {
+        auto processor = slot.load(std::memory_order_acquire);
+        if (processor == nullptr) {
+            continue;
+        }
+        const auto& stats = processor->scheduler.stats();
+        writer << "cpu " << std::uint64_t(processor->cpu->index()) << ": dispatched " << stats.dispatched
+               << ", stolen " << stats.stolen << ", wakeup latency " << stats.wakeupLatency << " max "
+               << stats.maxWakeupLatency << ", idle " << stats.idleTime << " cycles, wakeups " << stats.wakeups;
+        writer.newLine();
+    }
 }
 
 std::expected<Thread*, Error>
@@ -302,18 +790,56 @@ Kernel::createThread(OwningPointer<AddressSpace> addressSpace, std::uint64_t ent
 
     threads.pushFront(**thread);
 
+    // New threads have no working set yet; start them where the least work is waiting.
+    auto leastBusy = &currentProcessor();
+    for (const auto& slot : processors) {
+        auto processor = slot.load(std::memory_order_acquire);
+        if (processor != nullptr && processor->scheduler.size() < leastBusy->scheduler.size()) {
+            leastBusy = processor;
+        }
+    }
+    makeReady(*leastBusy, **thread);
+
     return thread;
 }
 
 void Kernel::killThread(Allocator& allocator, Thread& thread)
 {
     threads.remove(thread);
+    if (thread.processor != nullptr) {
+        thread.processor->scheduler.remove(thread);
+    }
     destruct(&thread, allocator);
 }
 
 void Kernel::scheduleThread(Thread& thread)
 {
-    cpu->scheduleContext(thread.context);
+    Cpu::current().scheduleContext(activate(currentProcessor(), thread));
+}
+
+std::optional<Error> Kernel::routeInterrupt(std::uint8_t irq, Processor& processor)
+{
+    auto guard = lockKernel(currentProcessor());
+    if (!interruptRouter) {
+        return UnroutableInterrupt;
+    }
+
+    return interruptRouter->route(irq, Cpu::IdtHardwareInterruptBase + irq, processor.cpu->apicId());
+}
+
+Context& Kernel::activate(Processor& processor, Thread& thread)
+{
+    catchUp(processor);
+
+    // Idle threads keep the address space which is loaded.
+    if (thread.addressSpace != nullptr) {
+        auto guard         = lockKernel(processor);
+        thread.context.cr3 = pcids.cr3(*thread.addressSpace, processor.cpu->index());
+    }
+    thread.processor = &processor;
+    processor.scheduler.start();
+    armTimer(processor, thread);
+    return thread.context;
 }
 
 std::expected<Thread*, Error> Kernel::loadProcess(InputStream<MemorySource>& elfStream)
@@ -335,7 +861,7 @@ std::expected<Thread*, Error> Kernel::loadProcess(InputStream<MemorySource>& elf
     // Alternatively, mininmize the amount of kernel code and data that is mapped into the process address space.
     (*processAddressSpace)
         ->shallowCopyRootMapping(
-            kernelThread()->addressSpace, VirtualAddress(0xFFFF8000'00000000), VirtualAddress(0xFFFFFFFF'FFFFFFF)
+            *kernelThread()->addressSpace, VirtualAddress(0xFFFF8000'00000000), VirtualAddress(0xFFFFFFFF'FFFFFFF)
         );
 
     for (const auto& segment : parsedElf->segments) {
@@ -355,39 +881,68 @@ std::expected<Thread*, Error> Kernel::loadProcess(InputStream<MemorySource>& elf
                 flags |= PageFlags::Writable;
             }
         }
-        auto region = (*processAddressSpace)->reserve(segment.virtualAddress, segment.fileSize, flags, PageSize::_4KiB);
-        if (region == nullptr) {
-            return std::unexpected(OutOfPhysicalMemory);
+        // Segments need not start at a page boundary; reserve whole pages. Pages beyond the file backed part of the
+        // segment (BSS) are zero-filled on demand. Like the zero page, writable pages which are mapped read-only are
+        // copied on the first write.
+        auto segmentStart = segment.virtualAddress - segment.virtualAddress % 4_KiB;
+        auto segmentSize  = segment.virtualAddress + segment.memorySize - segmentStart;
+        auto fileEnd      = segment.virtualAddress + segment.fileSize;
+        auto region       = (*processAddressSpace)
+                          ->reserve(segmentStart, segmentSize, flags, PageSize::_4KiB, RegionFlags::ZeroFillOnDemand);
+        if (!region) {
+            return std::unexpected(region.error());
         }
 
-        elfStream.seek(segment.fileOffset);
-        auto segmentStreamRange = StreamRange<std::byte, MemorySource>(elfStream) | std::views::take(segment.fileSize);
-        // Copy in chunks of 4_KiB so that we only need to map one page in the kernel address space at a time.
-        auto pageIndex = std::size_t(0);
-        for (auto chunk : segmentStreamRange | std::views::chunk(4_KiB)) {
+        // The initrd stays in memory. Whole pages of the file are mapped straight from its frames when the file offset
+        // and the virtual address of the segment agree modulo the page size.
+        auto fileStart = pageMapper->physicalAddress(elfStream.buffer().pointer() + segment.fileOffset);
+        auto shareable = (fileStart - segment.virtualAddress) % 4_KiB == 0;
+
+        // Copy page by page so that we only need to access one frame at a time.
+        auto cursor = (*processAddressSpace)->cursor();
+        for (auto page = segmentStart; page < fileEnd; page += 4_KiB) {
+            if (shareable && page >= segment.virtualAddress && page + 4_KiB <= fileEnd) {
+                // The frames of the initrd are not managed by the frame allocator, so they are never freed.
+                auto error = cursor.map(
+                    page, fileStart + (page - segment.virtualAddress), PageSize::_4KiB, flags & ~PageFlags::Writable
+                );
+                if (error) {
+                    return std::unexpected(CannotMapProcessMemory);
+                }
+                continue;
+            }
+
             auto frame = pageMapper->allocate();
             if (!frame) {
                 return std::unexpected(frame.error());
             }
+
+            // Zero the parts of the page outside of the file backed part of the segment.
             auto destination = reinterpret_cast<std::byte*>(frame->ptr);
-            auto copyResult  = std::ranges::copy(chunk, destination);
-            if (static_cast<std::size_t>(copyResult.out - destination) < segment.fileSize) {
+            auto begin       = std::max(page, segment.virtualAddress) - page;
+            auto end         = std::min(page + 4_KiB, fileEnd) - page;
+            memset(destination, 0, begin);
+            memset(destination + end, 0, 4_KiB - end);
+
+            elfStream.seek(segment.fileOffset + page + begin - segment.virtualAddress);
+            auto pageStreamRange = StreamRange<std::byte, MemorySource>(elfStream) | std::views::take(end - begin);
+            auto copyResult      = std::ranges::copy(pageStreamRange, destination + begin);
+            if (static_cast<std::size_t>(copyResult.out - destination) != end) {
+                pageMapper->deallocate(frame->physicalAddress, 4_KiB);
                 return std::unexpected(CannotCopySegment);
             }
-            // Map the region into the process address space.
-            auto error = (*region)->mapPage(frame->physicalAddress, pageIndex);
+
+            // Map the page into the process address space.
+            auto error = (*region)->mapPage(cursor, frame->physicalAddress, (page - segmentStart) / 4_KiB);
             if (error) {
+                pageMapper->deallocate(frame->physicalAddress, 4_KiB);
                 return std::unexpected(CannotMapProcessMemory);
             }
-            pageIndex++;
-            // TODO: Allocate more pages and initialize to zero if memorySize > fileSize.
-            // Using std::views::repeat along with std::views::concat would be sweet.
-            // Unfortunately, concat is not there yet (c++26)
         }
     }
 
     auto stackFlags = PageFlags::Present | PageFlags::Writable | PageFlags::UserAccessible | PageFlags::NoExecute;
-    auto stack      = (*processAddressSpace)->allocate(64_KiB, stackFlags, PageSize::_4KiB);
+    auto stack      = (*processAddressSpace)->allocateOnDemand(64_KiB, stackFlags, PageSize::_4KiB);
     if (!stack) {
         return std::unexpected(stack.error());
     }
@@ -407,21 +962,84 @@ std::expected<Thread*, Error> Kernel::loadProcess(InputStream<MemorySource>& elf
 
 void Kernel::onInterrupt(std::uint8_t Irq)
 {
-    auto result = interrupts.enqueue(HardwareInterrupt{Irq});
+    auto& processor = currentProcessor();
+    auto  result    = processor.interrupts.enqueue(HardwareInterrupt{Irq});
     if (!result) {
         panic("Interrupt buffer overflow");
     }
+
+    // The kernel thread handles the interrupt, and may be halted on another processor.
+    if (&processor != kernelThread()->processor) {
+        wake(*kernelThread()->processor);
+    }
 }
 
 Context& Kernel::onSyscall(Context& sender)
 {
+    // The kernel thread may free the address space of the sender as soon as it sees the message, while another
+    // processor would still translate through its page tables. Leave it before the message is sent.
+    auto& processor = currentProcessor();
+    if (processor.idleThread != kernelThread()) {
+        Register::CR3::write(kernelRootTable);
+    }
+
     auto origin = Thread::fromContext(sender);
     auto result = mailbox->enqueue(Message{origin});
     if (!result) {
         panic("Message buffer overflow");
     }
 
-    return kernelThread()->context;
+    // The sender waits until the kernel thread has handled its message, so that the kernel thread never finds it
+    // running on another processor. On the bootstrap processor, run the kernel thread right away to keep latency low.
+    if (processor.idleThread == kernelThread()) {
+        processor.scheduler.remove(*kernelThread());
+        return activate(processor, *kernelThread());
+    }
+
+    wake(*kernelThread()->processor);
+    auto next = pickNext(processor);
+    return activate(processor, next != nullptr ? *next : *processor.idleThread);
+}
+
+bool Kernel::onPageFault(Context& active, VirtualAddress address, PageFaultFlags::Type flags)
+{
+    // The kernel half is shared by all address spaces, but its regions are tracked by the kernel address space. Only
+    // the kernel faults there, and it might hold the lock already.
+    if (address >= StartKernelSpace) {
+        return !kernelThread()->addressSpace->handlePageFault(address, flags);
+    }
+
+    auto guard = lockKernel(currentProcessor());
+    return !Thread::fromContext(active)->addressSpace->handlePageFault(address, flags);
+}
+
+Context& Kernel::onTimer(Context& active, bool preemptible)
+{
+    // The interrupt may be a shootdown, which the sender waits for.
+    auto& processor = currentProcessor();
+    catchUp(processor);
+
+    // Kernel mode is only woken: the kernel thread and the idle threads pick the next thread themselves.
+    if (!preemptible) {
+        return active;
+    }
+
+    // The interrupt may also come from another processor, which made a thread ready here before the slice is over.
+    auto& thread = *Thread::fromContext(active);
+    if (!processor.scheduler.expired()) {
+        armTimer(processor, thread);
+        return active;
+    }
+
+    auto next = pickNext(processor);
+    if (next == nullptr) {
+        processor.scheduler.start();
+        armTimer(processor, thread);
+        return active;
+    }
+
+    makeReady(processor, thread);
+    return activate(processor, *next);
 }
 
 Thread* Kernel::kernelThread() const
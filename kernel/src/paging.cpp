@@ -1,6 +1,9 @@
 #include "kernel/paging.hpp"
+#include "kernel/cpu.hpp"
+#include <libr/memory.hpp>
 #include <utility>
 #include <algorithm>
+#include <bit>
 
 Block Block::align(std::size_t alignment) const
 {
@@ -23,47 +26,328 @@ VirtualAddress IdentityMapping::translate(std::size_t physicalAddress) const
     return physicalAddress + offset;
 }
 
+std::uintptr_t IdentityMapping::physicalAddress(VirtualAddress virtualAddress) const
+{
+    return virtualAddress - offset;
+}
+
+bool FrameZone::isCarved(std::uintptr_t physicalAddress, std::size_t size) const
+{
+    return physicalAddress >= startAddress && physicalAddress + size <= carvedAddress;
+}
+
+FrameDescriptor& FrameZone::descriptor(std::uintptr_t physicalAddress, std::size_t frameSize) const
+{
+    return descriptors[(physicalAddress - startAddress) / frameSize];
+}
+
 std::expected<PageFrameAllocator, rlib::Error> PageFrameAllocator::make(
     rlib::Iterator<Block>& memoryMap, IdentityMapping identityMapping, std::size_t frameSize, rlib::Allocator& allocator
 )
 {
-    auto freePageList = FreePageList::make(allocator);
-    if (!freePageList) {
+    auto freeLists = [&]<std::size_t... Orders>(std::index_sequence<Orders...>) -> std::optional<FreeLists> {
+        auto lists = std::array{((void)Orders, FreePageList::make(allocator))...};
+        if (std::ranges::any_of(lists, [](const auto& list) { return !list; })) {
+            return {};
+        }
+        return FreeLists{std::move(*lists[Orders])...};
+    }(std::make_index_sequence<MaxOrder + 1>{});
+    if (!freeLists) {
         return std::unexpected(rlib::OutOfMemoryError);
     }
 
-    return PageFrameAllocator{std::move(*freePageList), memoryMap, identityMapping, frameSize};
+    return PageFrameAllocator{std::move(*freeLists), memoryMap, identityMapping, frameSize};
 }
 
 PageFrameAllocator::PageFrameAllocator(
-    FreePageList freePages, rlib::Iterator<Block>& memoryMap, IdentityMapping identityMapping, std::size_t frameSize
+    FreeLists freeLists, rlib::Iterator<Block>& memoryMap, IdentityMapping identityMapping, std::size_t frameSize
 ) :
-    freePages(std::move(freePages)), identityMapping(identityMapping), frameSize(frameSize)
+    freeLists(std::move(freeLists)),
+    zones{},
+    numberOfZones(0),
+    carveZone(0),
+    identityMapping(identityMapping),
+    frameSize(frameSize),
+    _unusedMemory(0)
 {
+    // Firmware often lists adjacent ranges separately, for instance when they had different uses during boot.
+    auto pending = std::optional<Block>();
     for (auto block = memoryMap.next(); block; block = memoryMap.next()) {
-        auto alignedBlock = block->align(frameSize);
-        for (auto physicalAddress = alignedBlock.startAddress; physicalAddress < alignedBlock.endAddress();
-             physicalAddress += frameSize) {
-            dealloc(physicalAddress);
+        if (pending && pending->endAddress() == block->startAddress) {
+            pending->size += block->size;
+            continue;
         }
+        if (pending) {
+            addZone(*pending);
+        }
+        pending = *block;
+    }
+    if (pending) {
+        addZone(*pending);
     }
 }
 
-std::expected<Block, rlib::Error> PageFrameAllocator::alloc()
+std::expected<Block, rlib::Error> PageFrameAllocator::alloc(std::size_t order)
 {
-    if (freePages.empty()) {
+    if (order > MaxOrder) {
         return std::unexpected(OutOfPhysicalMemory);
     }
 
-    auto freePage = freePages.popFront();
-    return Block{freePage->physicalAddress, frameSize};
+    auto freeOrder = firstFreeOrder(order);
+    while (!freeOrder) {
+        if (!carve()) {
+            return std::unexpected(OutOfPhysicalMemory);
+        }
+        freeOrder = firstFreeOrder(order);
+    }
+
+    auto currentOrder    = *freeOrder;
+    auto freePage        = freeLists[currentOrder].popFront();
+    auto physicalAddress = freePage->physicalAddress;
+    auto zone            = findZone(physicalAddress);
+    zone->descriptor(physicalAddress, frameSize) = FrameDescriptor{0, false, 1, 0};
+
+    // Split the block, returning the upper halves to the free lists.
+    while (currentOrder > order) {
+        currentOrder--;
+        pushFree(*zone, physicalAddress + blockSize(currentOrder), currentOrder);
+    }
+
+    return Block{physicalAddress, blockSize(order)};
+}
+
+void PageFrameAllocator::dealloc(std::uintptr_t physicalAddress, std::size_t order)
+{
+    auto zone = findZone(physicalAddress);
+    if (zone == nullptr) {
+        return;
+    }
+
+    // Merge with the buddy for as long as the buddy is a free block of the same order.
+    for (; order < MaxOrder; order++) {
+        auto buddyAddress = physicalAddress ^ blockSize(order);
+        // Descriptors outside of the carved part of the zone are not initialized.
+        if (!zone->isCarved(buddyAddress, blockSize(order))) {
+            break;
+        }
+        auto& buddy = zone->descriptor(buddyAddress, frameSize);
+        if (buddy.freeOrder != order + 1) {
+            break;
+        }
+
+        freeLists[order].remove(*identityMapping.translate(buddyAddress).ptr<FreePage>());
+        buddy.freeOrder = 0;
+        physicalAddress = std::min(physicalAddress, buddyAddress);
+    }
+
+    pushFree(*zone, physicalAddress, order);
+}
+
+void PageFrameAllocator::acquire(std::uintptr_t physicalAddress, std::size_t order)
+{
+    auto zone = findZone(physicalAddress);
+    if (zone == nullptr) {
+        return;
+    }
+
+    if (!zone->descriptor(physicalAddress, frameSize).split) {
+        order = 0;
+    }
+    for (auto frame = physicalAddress; frame < physicalAddress + blockSize(order); frame += frameSize) {
+        zone->descriptor(frame, frameSize).references++;
+    }
+}
+
+bool PageFrameAllocator::release(std::uintptr_t physicalAddress, std::size_t order)
+{
+    auto zone = findZone(physicalAddress);
+    if (zone == nullptr) {
+        return false;
+    }
+
+    auto& descriptor = zone->descriptor(physicalAddress, frameSize);
+    if (descriptor.split && order > 0) {
+        auto returned = true;
+        for (auto frame = physicalAddress; frame < physicalAddress + blockSize(order); frame += frameSize) {
+            returned &= release(frame);
+        }
+        return returned;
+    }
+
+    if (--descriptor.references > 0) {
+        return false;
+    }
+
+    dealloc(physicalAddress, order);
+    return true;
+}
+
+std::size_t PageFrameAllocator::references(std::uintptr_t physicalAddress, std::size_t order)
+{
+    auto zone = findZone(physicalAddress);
+    if (zone == nullptr) {
+        return 0;
+    }
+
+    if (!zone->descriptor(physicalAddress, frameSize).split) {
+        order = 0;
+    }
+    auto references = std::size_t(0);
+    for (auto frame = physicalAddress; frame < physicalAddress + blockSize(order); frame += frameSize) {
+        references = std::max<std::size_t>(references, zone->descriptor(frame, frameSize).references);
+    }
+
+    return references;
+}
+
+FrameDescriptor* PageFrameAllocator::descriptor(std::uintptr_t physicalAddress)
+{
+    auto zone = findZone(physicalAddress);
+    if (zone == nullptr) {
+        return nullptr;
+    }
+
+    return &zone->descriptor(physicalAddress, frameSize);
+}
+
+void PageFrameAllocator::split(std::uintptr_t physicalAddress, std::size_t order)
+{
+    auto zone = findZone(physicalAddress);
+    if (zone == nullptr) {
+        return;
+    }
+
+    auto& head = zone->descriptor(physicalAddress, frameSize);
+    if (head.split) {
+        return;
+    }
+
+    auto references = head.references;
+    for (auto frame = physicalAddress; frame < physicalAddress + blockSize(order); frame += frameSize) {
+        zone->descriptor(frame, frameSize) = FrameDescriptor{0, true, references, 0};
+    }
+}
+
+std::size_t PageFrameAllocator::order(std::size_t size) const
+{
+    auto frames = (size + frameSize - 1) / frameSize;
+    return std::bit_width(std::max(frames, std::size_t(1)) - 1);
+}
+
+std::size_t PageFrameAllocator::unusedMemory() const
+{
+    return _unusedMemory;
+}
+
+void PageFrameAllocator::addZone(Block block)
+{
+    // Reserve frames at the start of the block to hold the descriptors.
+    auto alignedBlock     = block.align(frameSize);
+    auto frames           = alignedBlock.size / frameSize;
+    auto descriptorFrames = (frames * sizeof(FrameDescriptor) + frameSize - 1) / frameSize;
+    if (frames <= descriptorFrames) {
+        _unusedMemory += block.size;
+        return;
+    }
+
+    // Nothing has been carved yet, so the smallest zone can make way for a larger one.
+    auto zoneSize = [](const FrameZone& zone) { return zone.endAddress - zone.startAddress; };
+    if (numberOfZones == MaxZones) {
+        auto smallest = std::ranges::min_element(zones, {}, zoneSize);
+        if (zoneSize(*smallest) >= (frames - descriptorFrames) * frameSize) {
+            _unusedMemory += block.size;
+            return;
+        }
+        _unusedMemory += zoneSize(*smallest);
+        std::move(smallest + 1, zones.end(), smallest);
+        numberOfZones--;
+    }
+
+    auto startAddress = alignedBlock.startAddress + descriptorFrames * frameSize;
+    auto zone         = FrameZone{
+        startAddress,
+        startAddress,
+        alignedBlock.endAddress(),
+        identityMapping.translate(alignedBlock.startAddress).ptr<FrameDescriptor>()
+    };
+
+    // Keep the zones sorted by address, so that findZone can use binary search.
+    auto position = std::upper_bound(
+        zones.begin(),
+        zones.begin() + numberOfZones,
+        zone.startAddress,
+        [](auto address, const auto& other) { return address < other.startAddress; }
+    );
+    std::move_backward(position, zones.begin() + numberOfZones, zones.begin() + numberOfZones + 1);
+    *position = zone;
+    numberOfZones++;
+}
+
+bool PageFrameAllocator::carve()
+{
+    while (carveZone < numberOfZones && zones[carveZone].carvedAddress == zones[carveZone].endAddress) {
+        carveZone++;
+    }
+    if (carveZone == numberOfZones) {
+        return false;
+    }
+
+    // Carving the largest aligned block which fits guarantees that a buddy inside the carved part has been handed
+    // out as a block of its own, so its descriptor is initialized.
+    auto& zone            = zones[carveZone];
+    auto  physicalAddress = zone.carvedAddress;
+    auto  fits            = [&](std::size_t order) {
+        return physicalAddress % blockSize(order) == 0 && physicalAddress + blockSize(order) <= zone.endAddress;
+    };
+    auto order = MaxOrder;
+    while (order > 0 && !fits(order)) {
+        order--;
+    }
+
+    zone.carvedAddress += blockSize(order);
+    pushFree(zone, physicalAddress, order);
+    return true;
+}
+
+std::optional<std::size_t> PageFrameAllocator::firstFreeOrder(std::size_t order) const
+{
+    for (; order <= MaxOrder; order++) {
+        if (!freeLists[order].empty()) {
+            return order;
+        }
+    }
+
+    return {};
+}
+
+FrameZone* PageFrameAllocator::findZone(std::uintptr_t physicalAddress)
+{
+    auto next = std::upper_bound(
+        zones.begin(),
+        zones.begin() + numberOfZones,
+        physicalAddress,
+        [](auto address, const auto& zone) { return address < zone.startAddress; }
+    );
+    if (next == zones.begin()) {
+        return nullptr;
+    }
+
+    auto zone = std::prev(next);
+    return physicalAddress < zone->endAddress ? zone : nullptr;
 }
 
-void PageFrameAllocator::dealloc(std::uintptr_t physicalAddress)
+void PageFrameAllocator::pushFree(FrameZone& zone, std::uintptr_t physicalAddress, std::size_t order)
 {
+    zone.descriptor(physicalAddress, frameSize).freeOrder = order + 1;
+
     auto virtualAddress = identityMapping.translate(physicalAddress);
     auto freePage       = ::new (virtualAddress.ptr()) FreePage{physicalAddress, {}};
-    freePages.pushFront(*freePage);
+    freeLists[order].pushFront(*freePage);
+}
+
+std::size_t PageFrameAllocator::blockSize(std::size_t order) const
+{
+    return frameSize << order;
 }
 
 TableEntryView::TableEntryView(std::uint64_t& entry) : entry(&entry) {}
@@ -125,7 +409,7 @@ std::uintptr_t TableView::physicalAddress() const
 }
 
 PageMapper::PageMapper(IdentityMapping identityMapping, PageFrameAllocator allocator) :
-    identityMapping(identityMapping), frameAllocator(std::move(allocator))
+    identityMapping(identityMapping), frameAllocator(std::move(allocator)), _zeroFrame{}
 {}
 
 TableView PageMapper::mapTableView(std::uintptr_t physicalAddress) const
@@ -164,171 +448,252 @@ std::optional<rlib::Error> PageMapper::map(
     PageFlags::Type flags
 )
 {
-    auto indexLevel4 = virtualAddress.indexLevel4();
-    auto tableLevel3 = ensurePageTable(addressSpace.at(indexLevel4));
-    if (!tableLevel3) {
-        return tableLevel3.error();
-    }
+    auto size = static_cast<std::uint32_t>(pageSize);
+    return mapRange(addressSpace, virtualAddress, physicalAddress, size, pageSize, flags);
+}
 
-    auto indexLevel3 = virtualAddress.indexLevel3();
-    if (pageSize == PageSize::_1GiB) {
-        if (tableLevel3->at(indexLevel3)) {
-            return AlreadyMapped;
+std::optional<rlib::Error> PageMapper::mapRange(
+    TableView       addressSpace,
+    VirtualAddress  virtualAddress,
+    std::uint64_t   physicalAddress,
+    std::size_t     size,
+    PageSize        pageSize,
+    PageFlags::Type flags
+)
+{
+    auto pageSizeInBytes = static_cast<std::uint32_t>(pageSize);
+    auto cursor          = PageTableCursor(*this, addressSpace);
+    for (auto offset = std::size_t(0); offset < size; offset += pageSizeInBytes) {
+        auto error = cursor.map(virtualAddress + offset, physicalAddress + offset, pageSize, flags);
+        if (error) {
+            return error;
         }
-
-        tableLevel3->at(indexLevel3).setPhysicalAddress(physicalAddress).setFlags(flags | PageFlags::HugePage);
-
-        return {};
-    }
-    auto tableLevel2 = ensurePageTable(tableLevel3->at(indexLevel3));
-    if (!tableLevel2) {
-        return tableLevel2.error();
     }
 
-    auto indexLevel2 = virtualAddress.indexLevel2();
-    if (pageSize == PageSize::_2MiB) {
-        if (tableLevel2->at(indexLevel2)) {
-            return AlreadyMapped;
-        }
+    return {};
+}
 
-        tableLevel2->at(indexLevel2).setPhysicalAddress(physicalAddress).setFlags(flags | PageFlags::HugePage);
+std::optional<std::uintptr_t> PageMapper::read(TableView addressSpace, VirtualAddress virtualAddress)
+{
+    return PageTableCursor(*this, addressSpace).read(virtualAddress);
+}
 
-        return {};
-    }
-    auto tableLevel1 = ensurePageTable(tableLevel2->at(indexLevel2));
-    if (!tableLevel1) {
-        return tableLevel1.error();
-    }
+std::optional<Block> PageMapper::unmap(TableView addressSpace, VirtualAddress virtualAddress, TlbGather& gather)
+{
+    return PageTableCursor(*this, addressSpace).unmap(virtualAddress, gather);
+}
 
-    auto indexLevel1 = virtualAddress.indexLevel1();
-    if (tableLevel1->at(indexLevel1)) {
-        return AlreadyMapped;
+std::optional<Block>
+PageMapper::unmapAndDeallocate(TableView addressSpace, VirtualAddress virtualAddress, TlbGather& gather)
+{
+    auto block = unmap(addressSpace, virtualAddress, gather);
+    if (!block) {
+        return {};
     }
-    tableLevel1->at(indexLevel1).setPhysicalAddress(physicalAddress).setFlags(flags);
 
-    return {};
+    gather.release(*block);
+    return block;
 }
 
-std::optional<std::uintptr_t> PageMapper::read(TableView addressSpace, VirtualAddress virtualAddress)
+bool PageMapper::promote(TableView addressSpace, VirtualAddress virtualAddress, TlbGather& gather)
 {
-    auto indexLevel4 = virtualAddress.indexLevel4();
-    auto entryLevel4 = addressSpace.at(indexLevel4);
-    if (!entryLevel4) {
-        return {};
+    auto cursor = PageTableCursor(*this, addressSpace);
+    auto lookup = cursor.find(virtualAddress);
+    if (!lookup.entry || lookup.size != 4_KiB) {
+        return false;
     }
 
-    auto indexLevel3 = virtualAddress.indexLevel3();
-    auto tableLevel3 = mapTableView(entryLevel4);
-    auto entryLevel3 = tableLevel3.at(indexLevel3);
-    if (!entryLevel3) {
-        return {};
-    }
-    if (entryLevel3.flags() & PageFlags::HugePage) {
-        return entryLevel3.physicalAddress() + virtualAddress % 1_GiB;
+    // The table exists, so this does not allocate.
+    auto entry = cursor.ensure(virtualAddress, PageSize::_2MiB);
+    auto table = mapTableView(*entry);
+    auto flags = table.at(0).flags();
+    for (auto i = 0; i < 512; i++) {
+        auto page = table.at(i);
+        if (!page || page.flags() != flags || references(page.physicalAddress()) != 1) {
+            return false;
+        }
     }
 
-    auto indexLevel2 = virtualAddress.indexLevel2();
-    auto tableLevel2 = mapTableView(entryLevel3);
-    auto entryLevel2 = tableLevel2.at(indexLevel2);
-    if (!entryLevel2) {
-        return {};
+    auto block = frameAllocator.alloc(frameAllocator.order(2_MiB));
+    if (!block) {
+        return false;
     }
-    if (!entryLevel2 || entryLevel2.flags() & PageFlags::HugePage) {
-        return entryLevel2.physicalAddress() + virtualAddress % 2_MiB;
+    auto start = virtualAddress & ~(2_MiB - 1);
+    for (auto i = 0; i < 512; i++) {
+        auto page = table.at(i);
+        memcpy(translate(block->startAddress + i * 4_KiB).ptr(), translate(page.physicalAddress()).ptr(), 4_KiB);
+        gather.add(start + i * 4_KiB);
+        gather.release(Block{page.physicalAddress(), 4_KiB});
     }
 
-    auto indexLevel1 = virtualAddress.indexLevel1();
-    auto tableLevel1 = mapTableView(entryLevel2);
-    auto entryLevel1 = tableLevel1.at(indexLevel1);
-    if (!entryLevel1) {
-        return {};
-    }
-    return entryLevel1.physicalAddress() + virtualAddress % 4_KiB;
+    entry->setPhysicalAddress(block->startAddress).setFlags(flags | PageFlags::HugePage);
+    gather.releaseTable(Block{table.physicalAddress(), 4_KiB});
+    return true;
 }
 
-std::optional<Block> PageMapper::unmap(TableView addressSpace, VirtualAddress virtualAddress)
+std::optional<rlib::Error> PageMapper::demote(TableView addressSpace, VirtualAddress virtualAddress)
 {
-    auto indexLevel4 = virtualAddress.indexLevel4();
-    auto entryLevel4 = addressSpace.at(indexLevel4);
-    if (!entryLevel4) {
+    auto lookup = PageTableCursor(*this, addressSpace).find(virtualAddress);
+    if (!lookup.entry || lookup.size != 2_MiB) {
         return {};
     }
 
-    auto indexLevel3 = virtualAddress.indexLevel3();
-    auto tableLevel3 = mapTableView(entryLevel4);
-    auto entryLevel3 = tableLevel3.at(indexLevel3);
-    if (!entryLevel3) {
-        return {};
+    auto physicalAddress = lookup.entry->physicalAddress();
+    auto table = createPageTable();
+    if (!table) {
+        return table.error();
     }
-    if (entryLevel3.flags() & PageFlags::HugePage) {
-        entryLevel3.clear();
-        return Block{entryLevel3.physicalAddress(), 1_GiB};
+    auto flags = lookup.entry->flags() & ~PageFlags::HugePage;
+    for (auto i = 0; i < 512; i++) {
+        table->at(i).setPhysicalAddress(physicalAddress + i * 4_KiB).setFlags(flags);
     }
+    frameAllocator.descriptor(table->physicalAddress())->entries = 512;
+    // Each of the new pages holds a reference to its own frame, which other address spaces may share. Pinned frames,
+    // such as the framebuffer, are not managed by the allocator and are left alone.
+    frameAllocator.split(physicalAddress, frameAllocator.order(2_MiB));
 
-    auto indexLevel2 = virtualAddress.indexLevel2();
-    auto tableLevel2 = mapTableView(entryLevel3);
-    auto entryLevel2 = tableLevel2.at(indexLevel2);
-    if (!entryLevel2) {
-        return {};
+    lookup.entry->setPhysicalAddress(table->physicalAddress())
+        .setFlags(PageFlags::Present | PageFlags::Writable | PageFlags::UserAccessible);
+    return {};
+}
+
+void PageMapper::destroyPageTables(TableView addressSpace, VirtualAddress startAddress, VirtualAddress endAddress)
+{
+    destroyTables(addressSpace, 4, startAddress.index(4), endAddress.index(4));
+    frameAllocator.dealloc(addressSpace.physicalAddress());
+}
+
+void PageMapper::destroyTables(TableView table, std::uint8_t level, std::uint16_t firstIndex, std::uint16_t lastIndex)
+{
+    for (auto index = firstIndex; index <= lastIndex; index++) {
+        auto entry = table.at(index);
+        if (level > 1 && entry && !(entry.flags() & PageFlags::HugePage)) {
+            auto child = mapTableView(entry);
+            destroyTables(child, level - 1, 0, 511);
+            frameAllocator.dealloc(child.physicalAddress());
+        }
+        entry.clear();
     }
-    if (entryLevel2.flags() & PageFlags::HugePage) {
-        entryLevel2.clear();
-        return Block{entryLevel2.physicalAddress(), 2_MiB};
+}
+
+std::expected<PageFrame, rlib::Error> PageMapper::allocate(PageSize pageSize)
+{
+    return allocateContiguous(static_cast<std::uint32_t>(pageSize));
+}
+
+std::expected<PageFrame, rlib::Error> PageMapper::allocateContiguous(std::size_t size)
+{
+    auto block = frameAllocator.alloc(frameAllocator.order(size));
+    if (!block) {
+        return std::unexpected(OutOfPhysicalMemory);
     }
 
-    auto indexLevel1 = virtualAddress.indexLevel1();
-    auto tableLevel1 = mapTableView(entryLevel2);
-    auto entryLevel1 = tableLevel1.at(indexLevel1);
-    if (!entryLevel1) {
-        return {};
+    return PageFrame{identityMapping.translate(block->startAddress).ptr(), block->startAddress};
+}
+
+void PageMapper::deallocate(std::uintptr_t physicalAddress, std::size_t size)
+{
+    frameAllocator.dealloc(physicalAddress, frameAllocator.order(size));
+}
+
+std::size_t PageMapper::unusedMemory() const
+{
+    return frameAllocator.unusedMemory();
+}
+
+void PageMapper::acquire(std::uintptr_t physicalAddress, std::size_t size)
+{
+    if (physicalAddress == _zeroFrame) {
+        return;
     }
 
-    entryLevel1.clear();
-    return Block(entryLevel1.physicalAddress(), 4_KiB);
+    frameAllocator.acquire(physicalAddress, frameAllocator.order(size));
 }
 
-std::optional<Block> PageMapper::unmapAndDeallocate(TableView addressSpace, VirtualAddress virtualAddress)
+bool PageMapper::release(std::uintptr_t physicalAddress, std::size_t size)
 {
-    auto block = unmap(addressSpace, virtualAddress);
-    if (!block) {
-        return {};
+    if (physicalAddress == _zeroFrame) {
+        return false;
     }
 
-    for (auto i = std::size_t(0); i < block->size; i += 4_KiB) {
-        frameAllocator.dealloc(block->startAddress + i);
+    return frameAllocator.release(physicalAddress, frameAllocator.order(size));
+}
+
+std::size_t PageMapper::references(std::uintptr_t physicalAddress, std::size_t size)
+{
+    if (physicalAddress == _zeroFrame) {
+        return 0;
     }
-    return block;
+
+    return frameAllocator.references(physicalAddress, frameAllocator.order(size));
 }
 
-std::expected<PageFrame, rlib::Error> PageMapper::allocate()
+VirtualAddress PageMapper::translate(std::uintptr_t physicalAddress) const
 {
-    auto block = frameAllocator.alloc();
-    if (!block) {
-        return std::unexpected(OutOfPhysicalMemory);
+    return identityMapping.translate(physicalAddress);
+}
+
+std::uintptr_t PageMapper::physicalAddress(VirtualAddress virtualAddress) const
+{
+    return identityMapping.physicalAddress(virtualAddress);
+}
+
+bool PageMapper::identityMapped(VirtualAddress virtualAddress)
+{
+    // Addresses below the identity mapping wrap around to physical addresses outside of any zone.
+    return frameAllocator.descriptor(physicalAddress(virtualAddress)) != nullptr;
+}
+
+std::expected<std::uintptr_t, rlib::Error> PageMapper::zeroFrame()
+{
+    if (!_zeroFrame) {
+        auto frame = allocate();
+        if (!frame) {
+            return std::unexpected(frame.error());
+        }
+        memset(frame->ptr, 0, 4_KiB);
+        _zeroFrame = frame->physicalAddress;
     }
 
-    return PageFrame{identityMapping.translate(block->startAddress).ptr(), block->startAddress};
+    return *_zeroFrame;
 }
 
-std::optional<rlib::Error>
-PageMapper::allocateAndMap(TableView addressSpace, VirtualAddress virtualAddress, PageFlags::Type flags)
+std::optional<rlib::Error> PageMapper::allocateAndMap(
+    TableView addressSpace, VirtualAddress virtualAddress, PageFlags::Type flags, PageSize pageSize
+)
 {
-    auto block = frameAllocator.alloc();
+    auto block = frameAllocator.alloc(frameAllocator.order(static_cast<std::uint32_t>(pageSize)));
     if (!block) {
         return block.error();
     }
 
-    return map(addressSpace, virtualAddress, block->startAddress, PageSize::_4KiB, flags);
+    auto error = map(addressSpace, virtualAddress, block->startAddress, pageSize, flags);
+    if (error) {
+        frameAllocator.dealloc(block->startAddress, frameAllocator.order(block->size));
+    }
+    return error;
 }
 
 std::optional<rlib::Error> PageMapper::allocateAndMapRange(
-    TableView addressSpace, VirtualAddress virtualAddress, PageFlags::Type flags, std::size_t nFrames
+    TableView       addressSpace,
+    VirtualAddress  virtualAddress,
+    PageFlags::Type flags,
+    std::size_t     nPages,
+    PageSize        pageSize
 )
 {
-    // This has linear complexity. Optimize using a balanced tree or skip list.
-    for (auto i = std::size_t(0); i < nFrames; i++) {
-        auto error = allocateAndMap(addressSpace, virtualAddress + i * 4_KiB, flags);
+    auto pageSizeInBytes = static_cast<std::uint32_t>(pageSize);
+    auto pageOrder       = frameAllocator.order(pageSizeInBytes);
+    auto cursor          = PageTableCursor(*this, addressSpace);
+    for (auto i = std::size_t(0); i < nPages; i++) {
+        auto block = frameAllocator.alloc(pageOrder);
+        if (!block) {
+            return block.error();
+        }
+
+        auto error = cursor.map(virtualAddress + i * pageSizeInBytes, block->startAddress, pageSize, flags);
         if (error) {
+            frameAllocator.dealloc(block->startAddress, pageOrder);
             return error;
         }
     }
@@ -336,56 +701,242 @@ std::optional<rlib::Error> PageMapper::allocateAndMapRange(
     return {};
 }
 
-std::size_t PageMapper::unmapAndDeallocateRange(TableView addressSpace, VirtualAddress virtualAddress, std::size_t size)
+std::size_t PageMapper::unmapAndDeallocateRange(
+    TableView addressSpace, VirtualAddress virtualAddress, std::size_t size, TlbGather& gather
+)
+{
+    auto freed = std::size_t(0);
+    forEachMapping(addressSpace, virtualAddress, size, [&](auto& cursor, auto address, auto, auto pageSize) {
+        gather.release(*cursor.unmap(address, gather));
+        freed += pageSize;
+    });
+
+    return freed;
+}
+
+std::size_t PageMapper::protectRange(
+    TableView       addressSpace,
+    VirtualAddress  virtualAddress,
+    std::size_t     size,
+    PageFlags::Type flags,
+    TlbGather&      gather
+)
+{
+    auto changed = std::size_t(0);
+    forEachMapping(addressSpace, virtualAddress, size, [&](auto&, auto address, auto entry, auto pageSize) {
+        entry.setFlags(flags | (entry.flags() & PageFlags::HugePage));
+        gather.add(address);
+        changed += pageSize;
+    });
+
+    return changed;
+}
+
+std::size_t PageMapper::queryRange(TableView addressSpace, VirtualAddress virtualAddress, std::size_t size)
+{
+    auto mapped = std::size_t(0);
+    forEachMapping(addressSpace, virtualAddress, size, [&](auto&, auto, auto, auto pageSize) {
+        mapped += pageSize;
+    });
+
+    return mapped;
+}
+
+template<class Visitor>
+void PageMapper::forEachMapping(
+    TableView addressSpace, VirtualAddress virtualAddress, std::size_t size, Visitor&& visit
+)
 {
-    auto freed  = std::size_t(0);
-    auto offset = std::size_t(0);
+    auto cursor    = PageTableCursor(*this, addressSpace);
+    auto address   = std::uintptr_t(virtualAddress);
+    auto remaining = size;
+    while (remaining > 0) {
+        auto lookup = cursor.find(address);
+        if (lookup.entry) {
+            visit(cursor, VirtualAddress(address), *lookup.entry, lookup.size);
+        }
 
-    while (freed < size) {
-        auto block = unmapAndDeallocate(addressSpace, virtualAddress + offset);
-        if (block) {
-            freed += block->size;
+        // Unsigned arithmetic, so that a range which ends at the top of the address space terminates.
+        auto step = (address & ~(lookup.size - 1)) + lookup.size - address;
+        if (step >= remaining) {
+            break;
         }
-        offset += block->size;
+        remaining -= step;
+        address   += step;
     }
+}
 
-    return freed;
+TableView PageMapper::mapTableView(TableEntryView entry) const
+{
+    return mapTableView(entry.physicalAddress());
+}
+
+PageTableCursor::PageTableCursor(PageMapper& pageMapper, TableView tableLevel4) : pageMapper(&pageMapper), tags{}
+{
+    tables[4] = tableLevel4;
 }
 
-std::expected<TableView, rlib::Error> PageMapper::ensurePageTable(TableEntryView entry)
+PageTableCursor::Lookup PageTableCursor::find(VirtualAddress virtualAddress)
 {
-    if (entry) {
-        return mapTableView(entry);
+    for (auto level = resolvedLevel(virtualAddress, 1);; level--) {
+        auto entry = tables[level]->at(virtualAddress.index(level));
+        if (!entry) {
+            return {{}, entrySize(level)};
+        }
+        if (level == 1 || entry.flags() & PageFlags::HugePage) {
+            return {entry, entrySize(level)};
+        }
+
+        descend(virtualAddress, level, entry);
     }
+}
 
-    auto table = createPageTable();
-    if (!table) {
-        return std::unexpected(table.error());
+std::optional<std::uintptr_t> PageTableCursor::read(VirtualAddress virtualAddress)
+{
+    auto lookup = find(virtualAddress);
+    if (!lookup.entry) {
+        return {};
     }
 
-    entry.setPhysicalAddress(table->physicalAddress())
-        .setFlags(PageFlags::Present | PageFlags::Writable | PageFlags::UserAccessible);
+    return lookup.entry->physicalAddress() + virtualAddress % lookup.size;
+}
 
-    return table;
+std::expected<TableEntryView, rlib::Error> PageTableCursor::ensure(VirtualAddress virtualAddress, PageSize pageSize)
+{
+    auto targetLevel = level(static_cast<std::uint32_t>(pageSize));
+
+    for (auto level = resolvedLevel(virtualAddress, targetLevel); level > targetLevel; level--) {
+        auto entry = tables[level]->at(virtualAddress.index(level));
+        if (!entry) {
+            auto table = pageMapper->createPageTable();
+            if (!table) {
+                return std::unexpected(table.error());
+            }
+            entry.setPhysicalAddress(table->physicalAddress())
+                .setFlags(PageFlags::Present | PageFlags::Writable | PageFlags::UserAccessible);
+            countEntries(level, 1);
+        } else if (entry.flags() & PageFlags::HugePage) {
+            return std::unexpected(AlreadyMapped);
+        }
+
+        descend(virtualAddress, level, entry);
+    }
+
+    return tables[targetLevel]->at(virtualAddress.index(targetLevel));
 }
 
-TableView PageMapper::mapTableView(TableEntryView entry) const
+std::optional<rlib::Error> PageTableCursor::map(
+    VirtualAddress virtualAddress, std::uint64_t physicalAddress, PageSize pageSize, PageFlags::Type flags
+)
 {
-    return mapTableView(entry.physicalAddress());
+    auto entry = ensure(virtualAddress, pageSize);
+    if (!entry) {
+        return entry.error();
+    }
+    if (*entry) {
+        return AlreadyMapped;
+    }
+
+    if (pageSize != PageSize::_4KiB) {
+        flags |= PageFlags::HugePage;
+    }
+    entry->setPhysicalAddress(physicalAddress).setFlags(flags);
+    countEntries(level(static_cast<std::uint32_t>(pageSize)), 1);
+
+    return {};
+}
+
+std::optional<Block> PageTableCursor::unmap(VirtualAddress virtualAddress, TlbGather& gather)
+{
+    auto lookup = find(virtualAddress);
+    if (!lookup.entry) {
+        return {};
+    }
+
+    auto block = Block{lookup.entry->physicalAddress(), lookup.size};
+    lookup.entry->clear();
+    gather.add(virtualAddress);
+
+    // Free the tables which become empty on the way up. The level 3 tables of the kernel half are shared by all
+    // address spaces, and the root table lives as long as its address space.
+    for (auto level = this->level(lookup.size); level < 4; level++) {
+        auto descriptor = pageMapper->frameAllocator.descriptor(tables[level]->physicalAddress());
+        if (descriptor == nullptr || --descriptor->entries > 0) {
+            break;
+        }
+        if (level == 3 && virtualAddress >= StartKernelSpace) {
+            break;
+        }
+
+        gather.releaseTable(Block{tables[level]->physicalAddress(), 4_KiB});
+        tables[level].reset();
+        tables[level + 1]->at(virtualAddress.index(level + 1)).clear();
+    }
+
+    return block;
+}
+
+constexpr std::size_t PageTableCursor::entrySize(std::uint8_t level)
+{
+    return std::size_t(1) << (3 + 9 * level);
+}
+
+constexpr std::uintptr_t PageTableCursor::tag(VirtualAddress virtualAddress, std::uint8_t level)
+{
+    // A table at some level covers the range of a single entry one level up.
+    return virtualAddress >> (3 + 9 * (level + 1));
+}
+
+constexpr std::uint8_t PageTableCursor::level(std::size_t pageSize)
+{
+    return (std::countr_zero(pageSize) - 3) / 9;
+}
+
+void PageTableCursor::countEntries(std::uint8_t level, int delta)
+{
+    // Tables set up by the boot loader are not tracked.
+    auto descriptor = pageMapper->frameAllocator.descriptor(tables[level]->physicalAddress());
+    if (descriptor != nullptr) {
+        descriptor->entries += delta;
+    }
+}
+
+std::uint8_t PageTableCursor::resolvedLevel(VirtualAddress virtualAddress, std::uint8_t minimumLevel) const
+{
+    for (auto level = minimumLevel; level < 4; level++) {
+        if (tables[level] && tags[level] == tag(virtualAddress, level)) {
+            return level;
+        }
+    }
+
+    return 4;
+}
+
+void PageTableCursor::descend(VirtualAddress virtualAddress, std::uint8_t level, TableEntryView entry)
+{
+    tables[level - 1] = pageMapper->mapTableView(entry);
+    tags[level - 1]   = tag(virtualAddress, level - 1);
+
+    // Forget the tables further down, so that every cached table is a descendant of the tables cached above it.
+    for (auto lower = 1; lower < level - 1; lower++) {
+        tables[lower].reset();
+    }
 }
 
 Region::Region(
-    AddressSpace&   addressSpace,
-    VirtualAddress  virtualAddress,
-    std::size_t     sizeInFrames,
-    PageFlags::Type pageFlags,
-    PageSize        pageSize
+    AddressSpace&     addressSpace,
+    VirtualAddress    virtualAddress,
+    std::size_t       sizeInFrames,
+    PageFlags::Type   pageFlags,
+    PageSize          pageSize,
+    RegionFlags::Type regionFlags
 ) :
     addressSpace(&addressSpace),
     _start(virtualAddress),
     _sizeInFrames(sizeInFrames),
     pageFlags(pageFlags),
-    _pageSize(pageSize)
+    _pageSize(pageSize),
+    regionFlags(regionFlags)
 {}
 
 bool Region::operator<(const Region& other) const
@@ -395,14 +946,18 @@ bool Region::operator<(const Region& other) const
 
 std::optional<rlib::Error> Region::mapPage(std::uint64_t physicalAddress, std::size_t pageIndex)
 {
-    if (pageIndex > _sizeInFrames) {
+    auto cursor = addressSpace->cursor();
+    return mapPage(cursor, physicalAddress, pageIndex);
+}
+
+std::optional<rlib::Error>
+Region::mapPage(PageTableCursor& cursor, std::uint64_t physicalAddress, std::size_t pageIndex)
+{
+    if (pageIndex >= _sizeInFrames) {
         return OutOfBounds;
     }
 
-    auto offset = pageIndex * pageSizeInBytes();
-    return addressSpace->pageMapper->map(
-        addressSpace->tableLevel4, _start + offset, physicalAddress, _pageSize, pageFlags
-    );
+    return cursor.map(_start + pageIndex * pageSizeInBytes(), physicalAddress, _pageSize, pageFlags);
 }
 
 std::optional<rlib::Error> Region::allocatePage(std::size_t pageIndex)
@@ -412,12 +967,71 @@ std::optional<rlib::Error> Region::allocatePage(std::size_t pageIndex)
     }
 
     auto offset = pageIndex * pageSizeInBytes();
-    return addressSpace->pageMapper->allocateAndMap(addressSpace->tableLevel4, _start + offset, pageFlags);
+    return addressSpace->pageMapper->allocateAndMap(addressSpace->tableLevel4, _start + offset, pageFlags, _pageSize);
 }
 
 std::optional<rlib::Error> Region::allocate()
 {
-    return addressSpace->pageMapper->allocateAndMapRange(addressSpace->tableLevel4, _start, pageFlags, _sizeInFrames);
+    return commit(0, size());
+}
+
+std::optional<rlib::Error> Region::commit(std::size_t offset, std::size_t size)
+{
+    if (offset % pageSizeInBytes() != 0 || size % pageSizeInBytes() != 0 || offset + size > this->size()) {
+        return OutOfBounds;
+    }
+
+    auto pageMapper = addressSpace->pageMapper;
+    auto root       = addressSpace->tableLevel4;
+    auto start      = _start + offset;
+    auto end        = start + size;
+    if (!(regionFlags & RegionFlags::TransparentHugePages) || _pageSize != PageSize::_4KiB) {
+        return pageMapper->allocateAndMapRange(root, start, pageFlags, size / pageSizeInBytes(), _pageSize);
+    }
+
+    // Map the unaligned head and tail with 4 KiB pages and everything in between with 2 MiB pages. Fall back to
+    // 4 KiB pages when physical memory is too fragmented for a 2 MiB block.
+    auto hugeStart = std::min<std::uintptr_t>((start + 2_MiB - 1) & ~(2_MiB - 1), end);
+    auto hugeEnd   = std::max<std::uintptr_t>(end & ~(2_MiB - 1), hugeStart);
+    auto error     = pageMapper->allocateAndMapRange(root, start, pageFlags, (hugeStart - start) / 4_KiB);
+    for (auto address = hugeStart; !error && address < hugeEnd; address += 2_MiB) {
+        error = pageMapper->allocateAndMap(root, address, pageFlags, PageSize::_2MiB);
+        if (error == OutOfPhysicalMemory) {
+            error = pageMapper->allocateAndMapRange(root, address, pageFlags, 2_MiB / 4_KiB);
+        }
+    }
+    if (error) {
+        return error;
+    }
+
+    return pageMapper->allocateAndMapRange(root, hugeEnd, pageFlags, (end - hugeEnd) / 4_KiB);
+}
+
+std::optional<rlib::Error> Region::decommit(std::size_t offset, std::size_t size)
+{
+    if (offset % pageSizeInBytes() != 0 || offset + size > this->size()) {
+        return OutOfBounds;
+    }
+
+    auto pageMapper = addressSpace->pageMapper;
+    auto root       = addressSpace->tableLevel4;
+    auto start      = _start + offset;
+    for (auto boundary : {start, start + size}) {
+        if (boundary % 2_MiB == 0) {
+            continue;
+        }
+        auto error = pageMapper->demote(root, boundary);
+        if (error) {
+            return error;
+        }
+    }
+
+    auto gather = TlbGather(*pageMapper, root);
+    if (!gather.loaded()) {
+        addressSpace->invalidateTlb();
+    }
+    pageMapper->unmapAndDeallocateRange(root, start, size, gather);
+    return {};
 }
 
 VirtualAddress Region::start() const
@@ -440,11 +1054,134 @@ std::size_t Region::sizeInFrames() const
     return _sizeInFrames;
 }
 
+bool Region::contains(VirtualAddress address) const
+{
+    return address >= _start && address - _start < size();
+}
+
 std::size_t Region::pageSizeInBytes() const
 {
     return static_cast<std::uint32_t>(_pageSize);
 };
 
+bool Region::permits(PageFaultFlags::Type faultFlags) const
+{
+    return !(faultFlags & PageFaultFlags::Write && !(pageFlags & PageFlags::Writable))
+        && !(faultFlags & PageFaultFlags::User && !(pageFlags & PageFlags::UserAccessible))
+        && !(faultFlags & PageFaultFlags::InstructionFetch && pageFlags & PageFlags::NoExecute);
+}
+
+std::optional<rlib::Error> Region::zeroFillPage(std::size_t pageIndex)
+{
+    auto pageMapper = addressSpace->pageMapper;
+    auto address    = _start + pageIndex * pageSizeInBytes();
+    auto hugePages  = regionFlags & RegionFlags::TransparentHugePages && fitsHugePage(address);
+    if (hugePages && zeroFillHugePage(address)) {
+        return {};
+    }
+
+    auto frame = pageMapper->allocate(_pageSize);
+    if (!frame) {
+        return frame.error();
+    }
+    memset(frame->ptr, 0, pageSizeInBytes());
+
+    // Entries which are not present are never cached in the TLB, so there is nothing to invalidate.
+    auto error = mapPage(frame->physicalAddress, pageIndex);
+    if (error) {
+        pageMapper->deallocate(frame->physicalAddress, pageSizeInBytes());
+        return error;
+    }
+
+    // Once the last page of a 2 MiB range is touched, collapse the range into a single page.
+    if (hugePages) {
+        auto gather = TlbGather(*pageMapper, addressSpace->tableLevel4);
+        pageMapper->promote(addressSpace->tableLevel4, address, gather);
+    }
+    return {};
+}
+
+bool Region::zeroFillHugePage(VirtualAddress address)
+{
+    auto pageMapper = addressSpace->pageMapper;
+    auto hugePage   = address & ~(2_MiB - 1);
+    if (pageMapper->queryRange(addressSpace->tableLevel4, hugePage, 2_MiB) != 0) {
+        return false;
+    }
+
+    auto frame = pageMapper->allocate(PageSize::_2MiB);
+    if (!frame) {
+        return false;
+    }
+    memset(frame->ptr, 0, 2_MiB);
+
+    auto error =
+        pageMapper->map(addressSpace->tableLevel4, hugePage, frame->physicalAddress, PageSize::_2MiB, pageFlags);
+    if (error) {
+        pageMapper->deallocate(frame->physicalAddress, 2_MiB);
+        return false;
+    }
+    return true;
+}
+
+bool Region::fitsHugePage(VirtualAddress address) const
+{
+    auto hugePage = address & ~(2_MiB - 1);
+    return hugePage >= _start && end() - hugePage >= 2_MiB;
+}
+
+std::optional<rlib::Error> Region::mapZeroPage(std::size_t pageIndex)
+{
+    // The zero frame is a single small frame.
+    if (_pageSize != PageSize::_4KiB) {
+        return zeroFillPage(pageIndex);
+    }
+
+    auto zeroFrame = addressSpace->pageMapper->zeroFrame();
+    if (!zeroFrame) {
+        return zeroFrame.error();
+    }
+
+    auto cursor  = addressSpace->cursor();
+    auto address = _start + pageIndex * pageSizeInBytes();
+    return cursor.map(address, *zeroFrame, _pageSize, pageFlags & ~PageFlags::Writable);
+}
+
+std::optional<rlib::Error> Region::copyPage(std::size_t pageIndex)
+{
+    auto pageMapper = addressSpace->pageMapper;
+    auto lookup     = addressSpace->cursor().find(_start + pageIndex * pageSizeInBytes());
+    if (!lookup.entry) {
+        return NotMapped;
+    }
+
+    // The last owner of a frame may keep it. Pinned frames, such as those of the initrd, are always copied.
+    // With transparent huge pages, a region of small pages may be mapped by a 2 MiB page, which is copied whole.
+    auto physicalAddress = lookup.entry->physicalAddress();
+    if (pageMapper->references(physicalAddress, lookup.size) != 1) {
+        auto frame = pageMapper->allocate(PageSize(lookup.size));
+        if (!frame && lookup.size != pageSizeInBytes()) {
+            // Without a free block that large, only the faulting page is copied, out of the split 2 MiB page.
+            auto error = pageMapper->demote(addressSpace->tableLevel4, _start + pageIndex * pageSizeInBytes());
+            if (error) {
+                return error;
+            }
+            return copyPage(pageIndex);
+        }
+        if (!frame) {
+            return frame.error();
+        }
+        memcpy(frame->ptr, pageMapper->translate(physicalAddress).ptr(), lookup.size);
+
+        lookup.entry->setPhysicalAddress(frame->physicalAddress);
+        pageMapper->release(physicalAddress, lookup.size);
+    }
+
+    // The processor invalidates the translation of the faulting address itself, so there is no need for invlpg.
+    lookup.entry->setFlags(lookup.entry->flags() | PageFlags::Writable);
+    return {};
+}
+
 std::expected<rlib::OwningPointer<AddressSpace>, rlib::Error>
 AddressSpace::make(PageMapper& pageMapper, rlib::Allocator& allocator, std::uintptr_t startAddress, std::size_t size)
 {
@@ -453,18 +1190,20 @@ AddressSpace::make(PageMapper& pageMapper, rlib::Allocator& allocator, std::uint
         return std::unexpected(tableLevel4.error());
     }
 
-    auto regions = rlib::intrusive::List<Region>::make(allocator);
-    if (!regions) {
-        return std::unexpected(regions.error());
-    }
-
-    auto memoryResource = rlib::MemoryResource::make(startAddress, size, 16, allocator, allocator, allocator);
+    auto memoryResource = rlib::MemoryResource::make(startAddress, size, allocator, rlib::TreeIndex());
     if (!memoryResource) {
         return std::unexpected(memoryResource.error());
     }
 
     auto addressSpace = rlib::construct<AddressSpace>(
-        allocator, pageMapper, *tableLevel4, std::move(*regions), std::move(*memoryResource), allocator
+        allocator,
+        pageMapper,
+        *tableLevel4,
+        Regions(),
+        std::move(*memoryResource),
+        allocator,
+        startAddress,
+        size
     );
     if (addressSpace == nullptr) {
         return std::unexpected(rlib::OutOfMemoryError);
@@ -476,15 +1215,19 @@ AddressSpace::make(PageMapper& pageMapper, rlib::Allocator& allocator, std::uint
 AddressSpace::AddressSpace(
     PageMapper&                   pageMapper,
     TableView                     tableLevel4,
-    rlib::intrusive::List<Region> regions,
+    Regions                       regions,
     rlib::MemoryResource          memoryResource,
-    rlib::Allocator&              allocator
+    rlib::Allocator&              allocator,
+    std::uintptr_t                startAddress,
+    std::size_t                   size
 ) :
     pageMapper(&pageMapper),
     tableLevel4(tableLevel4),
     regions(std::move(regions)),
     memoryResource(std::move(memoryResource)),
-    allocator(&allocator)
+    allocator(&allocator),
+    startAddress(startAddress),
+    size(size)
 {}
 
 AddressSpace::AddressSpace(AddressSpace&& other) :
@@ -492,14 +1235,24 @@ AddressSpace::AddressSpace(AddressSpace&& other) :
     tableLevel4(other.tableLevel4),
     regions(std::move(other.regions)),
     memoryResource(std::move(other.memoryResource)),
-    allocator(other.allocator)
+    allocator(other.allocator),
+    startAddress(other.startAddress),
+    size(other.size),
+    pcid(other.pcid),
+    pcidGeneration(other.pcidGeneration),
+    pcidProcessor(other.pcidProcessor)
 {
     other.pageMapper = nullptr;
     other.allocator  = nullptr;
 }
 
-std::expected<Region*, rlib::Error>
-AddressSpace::reserve(VirtualAddress start, std::size_t size, PageFlags::Type flags, PageSize pageSize)
+std::expected<Region*, rlib::Error> AddressSpace::reserve(
+    VirtualAddress    start,
+    std::size_t       size,
+    PageFlags::Type   flags,
+    PageSize          pageSize,
+    RegionFlags::Type regionFlags
+)
 {
     auto pageSizeInBytes = static_cast<std::uint32_t>(pageSize);
     auto sizeInFrames    = (size + pageSizeInBytes - 1) / pageSizeInBytes;
@@ -509,40 +1262,56 @@ AddressSpace::reserve(VirtualAddress start, std::size_t size, PageFlags::Type fl
         return std::unexpected(beginOfAllocatedSpace.error());
     }
 
-    auto region = rlib::constructRaw<Region>(*allocator, *beginOfAllocatedSpace, sizeInFrames, flags, pageSize);
+    auto region = rlib::constructRaw<Region>(
+        *allocator, *this, *beginOfAllocatedSpace, sizeInFrames, flags, pageSize, regionFlags
+    );
     if (region == nullptr) {
         return std::unexpected(OutOfPhysicalMemory);
     }
-    regions.pushFront(*region);
+    regions.insert(*region);
 
     return region;
 }
 
-std::expected<Region*, rlib::Error> AddressSpace::reserve(std::size_t size, PageFlags::Type flags, PageSize pageSize)
+std::expected<Region*, rlib::Error>
+AddressSpace::reserve(std::size_t size, PageFlags::Type flags, PageSize pageSize, RegionFlags::Type regionFlags)
 {
     auto pageSizeInBytes = static_cast<std::uint32_t>(pageSize);
     auto sizeInFrames    = (size + pageSizeInBytes - 1) / pageSizeInBytes;
 
-    auto beginOfAllocatedSpace = memoryResource.allocate(sizeInFrames * pageSizeInBytes);
+    // Pages can only be mapped at addresses aligned to their size, and transparent huge pages only pay off if the
+    // region is aligned to them.
+    auto alignment = std::size_t(pageSizeInBytes);
+    if (regionFlags & RegionFlags::TransparentHugePages && sizeInFrames * pageSizeInBytes >= 2_MiB) {
+        alignment = std::max(alignment, 2_MiB);
+    }
+    auto beginOfAllocatedSpace = memoryResource.allocateAligned(sizeInFrames * pageSizeInBytes, alignment);
     if (!beginOfAllocatedSpace) {
         return std::unexpected(beginOfAllocatedSpace.error());
     }
 
-    auto region = rlib::constructRaw<Region>(*allocator, *beginOfAllocatedSpace, sizeInFrames, flags, pageSize);
+    auto region = rlib::constructRaw<Region>(
+        *allocator, *this, *beginOfAllocatedSpace, sizeInFrames, flags, pageSize, regionFlags
+    );
     if (region == nullptr) {
         return std::unexpected(OutOfPhysicalMemory);
     }
-    regions.pushFront(*region);
+    regions.insert(*region);
 
     return region;
 }
 
-std::expected<Region*, rlib::Error>
-AddressSpace::allocate(VirtualAddress start, std::size_t size, PageFlags::Type flags, PageSize pageSize)
+std::expected<Region*, rlib::Error> AddressSpace::allocate(
+    VirtualAddress    start,
+    std::size_t       size,
+    PageFlags::Type   flags,
+    PageSize          pageSize,
+    RegionFlags::Type regionFlags
+)
 {
-    auto region = reserve(start, size, flags, pageSize);
-    if (region == nullptr) {
-        return std::unexpected(OutOfPhysicalMemory);
+    auto region = reserve(start, size, flags, pageSize, regionFlags);
+    if (!region) {
+        return std::unexpected(region.error());
     }
 
     auto error = region.value()->allocate();
@@ -553,11 +1322,12 @@ AddressSpace::allocate(VirtualAddress start, std::size_t size, PageFlags::Type f
     return region;
 }
 
-std::expected<Region*, rlib::Error> AddressSpace::allocate(std::size_t size, PageFlags::Type flags, PageSize pageSize)
+std::expected<Region*, rlib::Error>
+AddressSpace::allocate(std::size_t size, PageFlags::Type flags, PageSize pageSize, RegionFlags::Type regionFlags)
 {
-    auto region = reserve(size, flags, pageSize);
-    if (region == nullptr) {
-        return std::unexpected(OutOfPhysicalMemory);
+    auto region = reserve(size, flags, pageSize, regionFlags);
+    if (!region) {
+        return std::unexpected(region.error());
     }
 
     auto error = region.value()->allocate();
@@ -568,6 +1338,62 @@ std::expected<Region*, rlib::Error> AddressSpace::allocate(std::size_t size, Pag
     return region;
 }
 
+std::expected<Region*, rlib::Error>
+AddressSpace::allocateOnDemand(std::size_t size, PageFlags::Type flags, PageSize pageSize)
+{
+    return reserve(size, flags, pageSize, RegionFlags::ZeroFillOnDemand);
+}
+
+std::optional<rlib::Error> AddressSpace::handlePageFault(VirtualAddress address, PageFaultFlags::Type faultFlags)
+{
+    auto region = findRegion(address);
+    if (region == nullptr) {
+        return NotMapped;
+    }
+    if (!region->permits(faultFlags)) {
+        return AccessViolation;
+    }
+
+    auto pageIndex = (address - region->_start) / region->pageSizeInBytes();
+    if (faultFlags & PageFaultFlags::Present) {
+        // The only legitimate fault on a present page is a write to a page with a shared frame.
+        if (faultFlags & PageFaultFlags::Write
+            && region->regionFlags & (RegionFlags::CopyOnWrite | RegionFlags::ZeroFillOnDemand)) {
+            return region->copyPage(pageIndex);
+        }
+        return AccessViolation;
+    }
+    if (region->regionFlags & RegionFlags::ZeroFillOnDemand) {
+        // There is no huge zero page; a read in a huge page region commits memory right away.
+        auto readOnly = !(faultFlags & PageFaultFlags::Write || region->regionFlags & RegionFlags::TransparentHugePages);
+        return readOnly ? region->mapZeroPage(pageIndex) : region->zeroFillPage(pageIndex);
+    }
+
+    return AccessViolation;
+}
+
+Region* AddressSpace::findRegion(VirtualAddress address) const
+{
+    auto region = regions.findLastSmallerOrEqual(address);
+    return region != nullptr && region->contains(address) ? region : nullptr;
+}
+
+std::ranges::subrange<AddressSpace::Regions::Iterator>
+AddressSpace::overlappingRegions(VirtualAddress start, std::size_t size) const
+{
+    // Only the last region starting at or before start can reach into the range from the left.
+    auto first = regions.findLastSmallerOrEqual(start);
+    if (first == nullptr || first->end() <= start) {
+        first = regions.findFirstGreaterOrEqual(start);
+    }
+    auto last = regions.findFirstGreaterOrEqual(VirtualAddress(start + size));
+    if (first == nullptr || first == last) {
+        return {regions.end(), regions.end()};
+    }
+
+    return {Regions::Iterator(first), Regions::Iterator(last)};
+}
+
 std::optional<std::uint64_t> Region::queryPhysicalAddress(std::size_t pageIndex) const
 {
     if (pageIndex > _sizeInFrames) {
@@ -579,37 +1405,97 @@ std::optional<std::uint64_t> Region::queryPhysicalAddress(std::size_t pageIndex)
 }
 
 std::expected<Region*, rlib::Error> AddressSpace::share(Region& region, PageFlags::Type flags) {
-    auto newRegion = reserve(region.size(), flags, region._pageSize);
+    auto newRegion = reserve(region.size(), flags, region._pageSize, RegionFlags::Shared);
     if (!newRegion) {
         return std::unexpected(newRegion.error());
     }
 
-    for (auto frame = std::size_t(0); frame > region.sizeInFrames(); frame++) {
-        auto physicalAddress = region.queryPhysicalAddress(frame);
-        if (!physicalAddress) {
+    auto source = region.addressSpace->cursor();
+    auto target = cursor();
+    for (auto frame = std::size_t(0); frame < region.sizeInFrames(); frame++) {
+        auto lookup = source.find(region._start + frame * region.pageSizeInBytes());
+        if (!lookup.entry) {
             return std::unexpected(NotMapped);
         }
-        auto error = (*newRegion)->mapPage(*physicalAddress, frame);
+        auto error = (*newRegion)->mapPage(target, lookup.entry->physicalAddress(), frame);
         if (error) {
             return std::unexpected(*error);
         }
+        pageMapper->acquire(lookup.entry->physicalAddress());
     }
 
     return newRegion;
 }
 
+std::expected<rlib::OwningPointer<AddressSpace>, rlib::Error> AddressSpace::clone()
+{
+    auto addressSpace = make(*pageMapper, *allocator, startAddress, size);
+    if (!addressSpace) {
+        return std::unexpected(addressSpace.error());
+    }
+
+    // Writable pages of this address space are made read-only below.
+    auto gather = TlbGather(*pageMapper, tableLevel4);
+    if (!gather.loaded()) {
+        invalidateTlb();
+    }
+
+    auto source = cursor();
+    auto target = (*addressSpace)->cursor();
+    for (auto& region : regions) {
+        if (region.regionFlags & RegionFlags::Shared) {
+            continue;
+        }
+        if (region.pageFlags & PageFlags::Writable) {
+            region.regionFlags |= RegionFlags::CopyOnWrite;
+        }
+
+        auto copy = (*addressSpace)
+                        ->reserve(region._start, region.size(), region.pageFlags, region._pageSize, region.regionFlags);
+        if (!copy) {
+            return std::unexpected(copy.error());
+        }
+
+        // Step over unmapped parts of the region a subtree at a time; regions populated on demand may be sparse.
+        for (auto offset = std::size_t(0); offset < region.size();) {
+            auto address = region._start + offset;
+            auto lookup  = source.find(address);
+            offset       = (address & ~(lookup.size - 1)) + lookup.size - region._start;
+            if (!lookup.entry) {
+                continue;
+            }
+
+            if (lookup.entry->flags() & PageFlags::Writable) {
+                lookup.entry->setFlags(lookup.entry->flags() & ~PageFlags::Writable);
+                gather.add(address);
+            }
+            // A region of small pages may hold transparent huge pages, which stay huge in the copy.
+            auto physicalAddress = lookup.entry->physicalAddress();
+            auto error           = target.map(address, physicalAddress, PageSize(lookup.size), lookup.entry->flags());
+            if (error) {
+                return std::unexpected(*error);
+            }
+            pageMapper->acquire(physicalAddress, lookup.size);
+        }
+    }
+
+    return addressSpace;
+}
+
 AddressSpace::~AddressSpace()
 {
     if (pageMapper == nullptr) {
         return;
     }
 
-    auto region = regions.popFront();
-    while (region != nullptr) {
-        pageMapper->unmapAndDeallocateRange(tableLevel4, region->start(), region->size());
-        destruct(region, *allocator);
-        region = regions.popFront();
-    }
+    auto gather = TlbGather(*pageMapper, tableLevel4);
+    regions.clear([&](Region& region) {
+        pageMapper->unmapAndDeallocateRange(tableLevel4, region.start(), region.size(), gather);
+        destruct(&region, *allocator);
+    });
+    gather.flush();
+
+    pageMapper->destroyPageTables(tableLevel4, startAddress, startAddress + size - 1);
 }
 
 std::uintptr_t AddressSpace::rootTablePhysicalAddress() const
@@ -617,6 +1503,16 @@ std::uintptr_t AddressSpace::rootTablePhysicalAddress() const
     return tableLevel4.physicalAddress();
 }
 
+void AddressSpace::invalidateTlb()
+{
+    pcidGeneration = 0;
+}
+
+PageTableCursor AddressSpace::cursor()
+{
+    return PageTableCursor(*pageMapper, tableLevel4);
+}
+
 void AddressSpace::shallowCopyRootMapping(
     const AddressSpace& from, VirtualAddress startAddress, VirtualAddress endAddress
 )
@@ -631,3 +1527,127 @@ void AddressSpace::shallowCopyRootMapping(
         tableLevel4.at(i) = from.tableLevel4.at(i);
     }
 }
+
+TlbGather::TlbGather(PageMapper& pageMapper, TableView addressSpace) :
+    pageMapper(&pageMapper),
+    addressSpace(addressSpace)
+{}
+
+void TlbGather::add(VirtualAddress virtualAddress)
+{
+    // Kernel mappings are global; reloading CR3 leaves them in place.
+    global = global || virtualAddress >= StartKernelSpace;
+    if (pageCount == Capacity) {
+        overflow = true;
+        return;
+    }
+
+    pages[pageCount++] = virtualAddress;
+}
+
+void TlbGather::release(Block block)
+{
+    if (frameCount == Capacity) {
+        flush();
+    }
+
+    frames[frameCount++] = block;
+}
+
+void TlbGather::releaseTable(Block block)
+{
+    release(block);
+    tables = true;
+}
+
+void TlbGather::flush()
+{
+    // Processors cache entries of higher level tables per PCID, and invlpg only drops those of the current one. The
+    // kernel half is shared by every PCID, so freeing one of its tables takes a flush of all of them.
+    if (global && tables) {
+        Register::CR4::flushTLBS();
+    } else if (global || loaded()) {
+        if (!overflow) {
+            for (auto i = std::size_t(0); i < pageCount; i++) {
+                Cpu::invalidatePage(pages[i]);
+            }
+        } else if (global) {
+            Register::CR4::flushTLBS();
+        } else {
+            Register::CR3::flushTLBS();
+        }
+    }
+
+    if (global) {
+        auto globalFlushes = _globalFlushes.fetch_add(1, std::memory_order_acq_rel) + 1;
+        if (_shootdown != nullptr) {
+            _shootdown->shootdown(globalFlushes);
+        }
+    }
+
+    for (auto i = std::size_t(0); i < frameCount; i++) {
+        pageMapper->release(frames[i].startAddress, frames[i].size);
+    }
+
+    pageCount  = 0;
+    frameCount = 0;
+    overflow   = false;
+    global     = false;
+    tables     = false;
+}
+
+bool TlbGather::loaded() const
+{
+    // The low bits of CR3 hold the PCID.
+    return (Register::CR3::read() & ~std::uint64_t(0xFFF)) == addressSpace.physicalAddress();
+}
+
+std::uint64_t TlbGather::globalFlushes()
+{
+    return _globalFlushes.load(std::memory_order_acquire);
+}
+
+void TlbGather::setShootdown(TlbShootdown& shootdown)
+{
+    _shootdown = &shootdown;
+}
+
+TlbGather::~TlbGather()
+{
+    flush();
+}
+
+std::atomic<std::uint64_t> TlbGather::_globalFlushes = 0;
+TlbShootdown*              TlbGather::_shootdown     = nullptr;
+
+void PcidAllocator::enable()
+{
+    enabled = true;
+}
+
+bool PcidAllocator::isEnabled() const
+{
+    return enabled;
+}
+
+std::uint64_t PcidAllocator::cr3(AddressSpace& addressSpace, std::size_t processor)
+{
+    auto root = addressSpace.rootTablePhysicalAddress();
+    if (!enabled) {
+        return root;
+    }
+
+    auto keep = addressSpace.pcidGeneration == generation && addressSpace.pcidProcessor == processor;
+    if (addressSpace.pcidGeneration != generation) {
+        // Entries of previous owners of a recycled PCID are flushed as it is loaded.
+        if (next > MaxPcid) {
+            generation++;
+            next = 1;
+        }
+        addressSpace.pcid           = next++;
+        addressSpace.pcidGeneration = generation;
+    }
+    addressSpace.pcidProcessor = processor;
+
+    return root | addressSpace.pcid | (keep ? Register::CR3::NoFlush : 0);
+}
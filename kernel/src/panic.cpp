@@ -1,4 +1,5 @@
 #include <kernel/panic.hpp>
+#include <utility>
 
 static FrameBufferInfo fb;
 
@@ -16,31 +17,69 @@ struct psf2_t {
 } __attribute__((packed));
 
 
-void panic(const char *message)
+static PanicObserver* observer = nullptr;
+
+static void drawGlyph(char c, std::uint32_t row, std::uint32_t column)
 {
-    psf2_t  *font = reinterpret_cast<psf2_t *>(&_binary_font_font_psf_start);
-    uint32_t kx   = 0;
-    auto     bpl  = (font->width + 7) / 8;
-
-    while (*message) {
-        auto mc    = *message > 0 && static_cast<unsigned char>(*message) < font->numglyph ? *message : 0;
-        auto glyph = &_binary_font_font_psf_start + font->headersize + font->bytesperglyph * mc;
-
-        auto offs = kx * (font->width + 1);
-        for (std::uint32_t y = 0; y < font->height; y++) {
-            auto line = offs;
-            for (std::uint32_t x = 0; x < font->width; x++) {
-                auto glyphBit     = static_cast<unsigned char>(*(glyph + x / 8)) & (0x80 >> (x % 8));
-                *(fb.base + line) = glyphBit ? 0xffffff : 0;
-                line++;
-            }
-            *(fb.base + line) = 0;
-
-            glyph += bpl;
-            offs += fb.scanline / 4;
+    auto font  = reinterpret_cast<psf2_t*>(&_binary_font_font_psf_start);
+    auto bpl   = (font->width + 7) / 8;
+    auto mc    = c > 0 && static_cast<unsigned char>(c) < font->numglyph ? c : 0;
+    auto glyph = &_binary_font_font_psf_start + font->headersize + font->bytesperglyph * mc;
+
+    auto offs = row * font->height * (fb.scanline / 4) + column * (font->width + 1);
+    for (std::uint32_t y = 0; y < font->height; y++) {
+        auto line = offs;
+        for (std::uint32_t x = 0; x < font->width; x++) {
+            auto glyphBit     = static_cast<unsigned char>(*(glyph + x / 8)) & (0x80 >> (x % 8));
+            *(fb.base + line) = glyphBit ? 0xffffff : 0;
+            line++;
         }
-        message++;
-        kx++;
+        *(fb.base + line) = 0;
+
+        glyph += bpl;
+        offs += fb.scanline / 4;
+    }
+}
+
+PanicWriter& PanicWriter::operator<<(const char* text)
+{
+    while (*text) {
+        drawGlyph(*text, row, column);
+        text++;
+        column++;
+    }
+
+    return *this;
+}
+
+PanicWriter& PanicWriter::operator<<(std::uint64_t value)
+{
+    char digits[21];
+    auto p = digits + sizeof(digits) - 1;
+    *p     = 0;
+    do {
+        *--p = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    return *this << p;
+}
+
+void PanicWriter::newLine()
+{
+    row++;
+    column = 0;
+}
+
+void panic(const char *message)
+{
+    auto writer = PanicWriter();
+    writer << message;
+    writer.newLine();
+
+    // Clear the observer first, so that a panic while reporting does not recurse.
+    if (auto current = std::exchange(observer, nullptr); current != nullptr) {
+        current->onPanic(writer);
     }
 
     asm("cli;"
@@ -57,3 +96,8 @@ void initializePanicHandler(FrameBufferInfo frameBufferInfo)
 {
     fb = frameBufferInfo;
 }
+
+void setPanicObserver(PanicObserver& panicObserver)
+{
+    observer = &panicObserver;
+}
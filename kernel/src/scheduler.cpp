@@ -0,0 +1,156 @@
+#include "kernel/kernel.hpp"
+#include <algorithm>
+
+using namespace rlib;
+
+std::expected<Scheduler, Error> Scheduler::make(Allocator& allocator)
+{
+    auto runQueue = RunQueue::make(allocator);
+    if (!runQueue) {
+        return std::unexpected(runQueue.error());
+    }
+
+    return Scheduler(std::move(*runQueue));
+}
+
+Scheduler::Scheduler(RunQueue runQueue) : runQueue(std::move(runQueue)) {}
+
+Scheduler::Scheduler(Scheduler&& other) :
+    runQueue(std::move(other.runQueue)),
+    length(other.length.load(std::memory_order_relaxed)),
+    stealableLength(other.stealableLength.load(std::memory_order_relaxed)),
+    _sliceEnd(other._sliceEnd),
+    _stats(other._stats)
+{}
+
+void Scheduler::enqueue(Thread& thread)
+{
+    auto guard        = LockGuard(lock);
+    thread.readySince = Register::TSC::read();
+    runQueue.pushBack(thread);
+    length.fetch_add(1, std::memory_order_relaxed);
+    if (!thread.pinned) {
+        stealableLength.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void Scheduler::remove(Thread& thread)
+{
+    auto guard = LockGuard(lock);
+    // An unlinked node points back at itself.
+    if (thread.runQueueNode.prev != &thread.runQueueNode) {
+        unlink(thread);
+    }
+}
+
+Thread* Scheduler::dequeue()
+{
+    if (size() == 0) {
+        return nullptr;
+    }
+
+    auto guard  = LockGuard(lock);
+    auto thread = runQueue.front();
+    if (thread != nullptr) {
+        take(*thread);
+    }
+
+    return thread;
+}
+
+Thread* Scheduler::steal()
+{
+    if (stealableSize() == 0 || !lock.tryLock()) {
+        return nullptr;
+    }
+
+    auto stolen = findStealable();
+    if (stolen != nullptr) {
+        take(*stolen);
+        _stats.stolen++;
+    }
+    lock.unlock();
+
+    return stolen;
+}
+
+Thread* Scheduler::migrate()
+{
+    if (stealableSize() == 0 || !lock.tryLock()) {
+        return nullptr;
+    }
+
+    auto migrated = findStealable();
+    if (migrated != nullptr) {
+        unlink(*migrated);
+    }
+    lock.unlock();
+
+    return migrated;
+}
+
+Thread* Scheduler::findStealable()
+{
+    auto now      = Register::TSC::read();
+    auto eligible = [&](const Thread& thread) { return !thread.pinned && now - thread.readySince >= CacheHotCycles; };
+    auto thread   = std::ranges::find_if(runQueue, eligible);
+
+    return thread != runQueue.end() ? &*thread : nullptr;
+}
+
+void Scheduler::unlink(Thread& thread)
+{
+    runQueue.remove(thread);
+    length.fetch_sub(1, std::memory_order_relaxed);
+    if (!thread.pinned) {
+        stealableLength.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+void Scheduler::take(Thread& thread)
+{
+    unlink(thread);
+
+    auto latency = Register::TSC::read() - thread.readySince;
+
+    _stats.dispatched++;
+    _stats.wakeupLatency += latency;
+    _stats.maxWakeupLatency = std::max(_stats.maxWakeupLatency, latency);
+}
+
+std::size_t Scheduler::size() const
+{
+    return length.load(std::memory_order_relaxed);
+}
+
+std::size_t Scheduler::stealableSize() const
+{
+    return stealableLength.load(std::memory_order_relaxed);
+}
+
+void Scheduler::start()
+{
+    _sliceEnd = Register::TSC::read() + TimeSlice * Cpu::tscFrequency() / 1000;
+}
+
+bool Scheduler::expired() const
+{
+    return Register::TSC::read() >= _sliceEnd;
+}
+
+std::uint64_t Scheduler::sliceEnd() const
+{
+    return _sliceEnd;
+}
+
+void Scheduler::idle(std::uint64_t cycles)
+{
+    auto guard = LockGuard(lock);
+    _stats.idleTime += cycles;
+    _stats.wakeups++;
+}
+
+const SchedulerStats& Scheduler::stats() const
+{
+    return _stats;
+}
@@ -0,0 +1,115 @@
+#include "kernel/slab.hpp"
+#include <utility>
+#include <algorithm>
+#include <new>
+
+std::expected<SlabAllocator, rlib::Error> SlabAllocator::make(PageMapper& pageMapper, rlib::Allocator& allocator)
+{
+    auto caches = [&]<std::size_t... Classes>(std::index_sequence<Classes...>) -> std::optional<Caches> {
+        auto lists = std::array{((void)Classes, SlabList::make(allocator))...};
+        if (std::ranges::any_of(lists, [](const auto& list) { return !list; })) {
+            return {};
+        }
+        return Caches{std::move(*lists[Classes])...};
+    }(std::make_index_sequence<SizeClasses>{});
+    if (!caches) {
+        return std::unexpected(rlib::OutOfMemoryError);
+    }
+
+    return SlabAllocator(pageMapper, std::move(*caches));
+}
+
+SlabAllocator::SlabAllocator(PageMapper& pageMapper, Caches caches) :
+    pageMapper(&pageMapper),
+    caches(std::move(caches))
+{}
+
+std::size_t SlabAllocator::sizeClass(std::size_t bytes, std::size_t alignment)
+{
+    auto size = std::max({bytes, alignment, MinObjectSize});
+    if (size > MaxObjectSize) {
+        return SizeClasses;
+    }
+
+    return std::bit_width(size - 1) - std::countr_zero(MinObjectSize);
+}
+
+std::size_t SlabAllocator::objectSize(std::size_t sizeClass)
+{
+    return MinObjectSize << sizeClass;
+}
+
+SlabAllocator::Slab& SlabAllocator::slabOf(void* object)
+{
+    auto slabStart = reinterpret_cast<std::uintptr_t>(object) & ~(SlabSize - 1);
+    return *reinterpret_cast<Slab*>(slabStart + SlabSize - sizeof(Slab));
+}
+
+SlabAllocator::Slab* SlabAllocator::grow(std::size_t sizeClass)
+{
+    auto frame = pageMapper->allocate();
+    if (!frame) {
+        return nullptr;
+    }
+
+    // Objects start at the beginning of the frame, so that they are aligned to their size.
+    auto start = static_cast<std::byte*>(frame->ptr);
+    auto slab  = ::new (start + SlabSize - sizeof(Slab)) Slab{{}, nullptr, 0, static_cast<std::uint8_t>(sizeClass)};
+    auto size  = objectSize(sizeClass);
+    for (auto i = (SlabSize - sizeof(Slab)) / size; i-- > 0;) {
+        slab->freeObjects = ::new (start + i * size) FreeObject{slab->freeObjects};
+    }
+
+    caches[sizeClass].pushFront(*slab);
+    return slab;
+}
+
+void* SlabAllocator::do_allocate(std::size_t bytes, std::size_t alignment)
+{
+    auto sizeClass = this->sizeClass(bytes, alignment);
+    if (sizeClass == SizeClasses) {
+        return nullptr;
+    }
+
+    auto slab = caches[sizeClass].front();
+    if (slab == nullptr) {
+        slab = grow(sizeClass);
+        if (slab == nullptr) {
+            return nullptr;
+        }
+    }
+
+    auto object       = slab->freeObjects;
+    slab->freeObjects = object->next;
+    slab->usedObjects++;
+    if (slab->freeObjects == nullptr) {
+        caches[sizeClass].remove(*slab);
+    }
+
+    return object;
+}
+
+void SlabAllocator::do_deallocate(void* p, std::size_t, std::size_t)
+{
+    auto& slab  = slabOf(p);
+    auto& cache = caches[slab.sizeClass];
+    if (slab.freeObjects == nullptr) {
+        cache.pushFront(slab);
+    }
+    slab.freeObjects = ::new (p) FreeObject{slab.freeObjects};
+    slab.usedObjects--;
+
+    // Keep the last slab of a size class, so that alternating allocations and frees do not hit the frame allocator.
+    auto lastSlab = cache.front() == &slab && slab.node.next == nullptr;
+    if (slab.usedObjects == 0 && !lastSlab) {
+        cache.remove(slab);
+        auto slabStart = reinterpret_cast<std::uintptr_t>(p) & ~(SlabSize - 1);
+        pageMapper->deallocate(pageMapper->physicalAddress(slabStart), SlabSize);
+    }
+}
+
+bool SlabAllocator::do_owns(void* p) const
+{
+    // Slabs are the only objects of the kernel heap which live in the identity mapping.
+    return pageMapper->identityMapped(p);
+}
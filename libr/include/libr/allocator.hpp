@@ -3,6 +3,9 @@
 #include <cstddef>
 #include <new>
 #include <utility>
+#include <array>
+#include <bit>
+#include <algorithm>
 #include "error.hpp"
 
 
@@ -79,6 +82,10 @@ namespace rlib {
             primary(std::move(primary)), secondary(std::move(secondary))
         {}
 
+        const PrimaryAllocator& primaryAllocator() const { return primary; }
+
+        const SecondaryAllocator& secondaryAllocator() const { return secondary; }
+
     private:
         PrimaryAllocator   primary;
         SecondaryAllocator secondary;
@@ -104,6 +111,59 @@ namespace rlib {
         virtual bool do_owns(void* p) const final { return primary.owns(p) || secondary.owns(p); }
     };
 
+    struct AllocatorStats {
+        static constexpr auto HistogramBuckets = std::size_t(32);
+
+        std::size_t allocations         = 0;
+        std::size_t deallocations       = 0;
+        // Requests which the wrapped allocator returned nullptr for. In a FallbackAllocator, the primary declines the
+        // requests it does not serve by design, so only the declines of the last link are failures of the chain.
+        std::size_t declinedAllocations = 0;
+        std::size_t liveBytes           = 0;
+        std::size_t peakBytes           = 0;
+        // Successful allocations by size. Bucket i counts sizes below 2^i, but not below 2^(i-1); the last bucket also
+        // counts all larger sizes.
+        std::array<std::size_t, HistogramBuckets> sizeHistogram{};
+    };
+
+    // Decorator which keeps statistics of the requests served by the wrapped allocator.
+    template<IsAllocator BaseAllocator>
+    class StatsAllocator : public Allocator {
+    public:
+        explicit StatsAllocator(BaseAllocator base) : base(std::move(base)) {}
+
+        const AllocatorStats& stats() const { return _stats; }
+
+    private:
+        BaseAllocator  base;
+        AllocatorStats _stats;
+
+        virtual void* do_allocate(std::size_t bytes, std::size_t alignment) final
+        {
+            auto p = base.allocate(bytes, alignment);
+            if (p == nullptr) {
+                _stats.declinedAllocations++;
+                return nullptr;
+            }
+
+            auto bucket = std::min<std::size_t>(std::bit_width(bytes), AllocatorStats::HistogramBuckets - 1);
+            _stats.allocations++;
+            _stats.sizeHistogram[bucket]++;
+            _stats.liveBytes += bytes;
+            _stats.peakBytes  = std::max(_stats.peakBytes, _stats.liveBytes);
+            return p;
+        }
+
+        virtual void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) final
+        {
+            base.deallocate(p, bytes, alignment);
+            _stats.deallocations++;
+            _stats.liveBytes -= bytes;
+        }
+
+        virtual bool do_owns(void* p) const final { return base.owns(p); }
+    };
+
 
     template<typename T, IsAllocator Alloc, class... Args>
     T* constructRaw(Alloc& allocator, Args&&... args)
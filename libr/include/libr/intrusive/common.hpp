@@ -55,4 +55,14 @@ namespace rlib::intrusive {
         return Mapped(std::move(a), std::move(b));
     }
 
+    template<class T, class M, M T::*Member>
+    struct ProjectMember {
+        M operator()(const T& value) const { return value.*Member; }
+    };
+
+    template<class T, class M, M (T::*MemberFunc)() const>
+    struct ProjectMemberFunc {
+        M operator()(const T& value) const { return (value.*MemberFunc)(); }
+    };
+
 } // namespace rlib::intrusive
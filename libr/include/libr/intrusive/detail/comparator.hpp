@@ -0,0 +1,41 @@
+#pragma once
+
+#include <type_traits>
+#include <functional>
+
+namespace rlib::intrusive::detail {
+
+    template<class T, class Project>
+    using Projected = std::remove_cvref_t<std::invoke_result_t<Project, const T&>>;
+
+    template<class T, class LessThan, class Project, bool = std::is_same_v<Projected<T, Project>, T>>
+    struct Comparator {
+        bool operator()(const Projected<T, Project>& a, const T& b) const
+        {
+            auto lessThan = LessThan{};
+            auto project  = Project{};
+            return lessThan(a, project(b));
+        }
+
+        bool operator()(const T& a, const Projected<T, Project>& b) const
+        {
+            auto lessThan = LessThan{};
+            auto project  = Project{};
+            return lessThan(project(a), b);
+        }
+
+        bool operator()(const T& a, const T& b) const
+        {
+            auto lessThan = LessThan{};
+            auto project  = Project{};
+            return lessThan(project(a), project(b));
+        }
+    };
+
+    // Specialization when Projected<T, Project> and T are the same type
+    template<class T, class LessThan, class Project>
+    struct Comparator<T, LessThan, Project, true> {
+        bool operator()(const T& a, const T& b) const { return LessThan{}(a, b); }
+    };
+
+} // namespace rlib::intrusive::detail
@@ -0,0 +1,224 @@
+#pragma once
+
+#include "common.hpp"
+#include "detail/comparator.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include <bit>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+
+namespace rlib::intrusive {
+
+    // Skip list node which holds all of its links, and fills exactly one cache line.
+    template<class T>
+    struct alignas(64) InlineSkipListNode {
+        static constexpr auto Levels = std::size_t(7);
+
+        InlineSkipListNode() = default;
+
+        InlineSkipListNode(const InlineSkipListNode&) = delete;
+
+        InlineSkipListNode& operator=(const InlineSkipListNode&) = delete;
+
+        std::array<T*, Levels> next{};
+        std::uint8_t           height = 0;
+    };
+
+    /**
+     * Geometric heights with p = 1/4, drawn from a xorshift generator.
+     *
+     * Unlike Deterministic, the heights do not depend on the number of elements, so the list stays balanced under
+     * removals. Every list has its own generator state, so lists used by different CPUs share no cache lines.
+     */
+    class RandomHeight {
+    public:
+        explicit RandomHeight(std::uint64_t seed = 0x9e3779b97f4a7c15) : state(seed | 1) {}
+
+        std::size_t operator()(std::size_t maxLevels)
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+
+            // Every two zero bits below the lowest set bit add a level.
+            auto height = 1 + static_cast<std::size_t>(std::countr_zero(state)) / 2;
+            return std::min(height, maxLevels);
+        }
+
+    private:
+        std::uint64_t state;
+    };
+
+    template<typename T, NodeGetter<T, InlineSkipListNode> NG>
+    class InlineSkipListIterator {
+    public:
+        using value_type      = T;
+        using difference_type = std::ptrdiff_t;
+
+        InlineSkipListIterator() = default;
+
+        explicit InlineSkipListIterator(T* element) : element(element) {}
+
+        T* operator->() const { return element; }
+
+        T& operator*() const { return *element; }
+
+        InlineSkipListIterator& operator++()
+        {
+            element = NG{}(element).next[0];
+            return *this;
+        }
+
+        InlineSkipListIterator operator++(int)
+        {
+            auto current = *this;
+            element      = NG{}(element).next[0];
+            return current;
+        }
+
+        bool operator==(const InlineSkipListIterator& other) const { return element == other.element; }
+
+    private:
+        T* element = nullptr;
+    };
+
+    /**
+     * Singly linked skip list whose links live in the elements.
+     *
+     * In contrast to SkipList, neither the list nor its elements own memory: the head is part of the list, and
+     * inserting cannot fail. Elements with equal keys are ordered by address, which makes the order total, so that
+     * an element can be found again for removal in O(log n) without back links.
+     */
+    template<
+        class T,
+        NodeGetter<T, InlineSkipListNode> NG = NodeFromBase<T, InlineSkipListNode>,
+        class Project                        = std::identity,
+        class LessThan                       = std::less<detail::Projected<T, Project>>,
+        class HeightPolicy                   = RandomHeight>
+    class InlineSkipList {
+    public:
+        static constexpr auto Levels = InlineSkipListNode<T>::Levels;
+
+        using Iterator = InlineSkipListIterator<T, NG>;
+
+        static_assert(std::forward_iterator<Iterator>);
+
+        InlineSkipList() = default;
+
+        explicit InlineSkipList(HeightPolicy heightPolicy) : heightPolicy(std::move(heightPolicy)) {}
+
+        void insert(T& value)
+        {
+            auto& node  = NG{}(value);
+            node.height = static_cast<std::uint8_t>(heightPolicy(Levels));
+
+            auto links = head.data();
+            for (auto level = Levels; level-- > 0;) {
+                while (links[level] != nullptr && before(*links[level], value)) {
+                    links = NG{}(links[level]).next.data();
+                }
+                if (level < node.height) {
+                    node.next[level] = links[level];
+                    links[level]     = &value;
+                }
+            }
+        }
+
+        void remove(T& value)
+        {
+            auto& node  = NG{}(value);
+            auto  links = head.data();
+            for (auto level = Levels; level-- > 0;) {
+                while (links[level] != nullptr && before(*links[level], value)) {
+                    links = NG{}(links[level]).next.data();
+                }
+                if (level < node.height) {
+                    links[level]     = node.next[level];
+                    node.next[level] = nullptr;
+                }
+            }
+        }
+
+        template<class U>
+        T* find(const U& value) const
+        {
+            auto lessThan = detail::Comparator<T, LessThan, Project>{};
+            auto element  = findFirstGreaterOrEqual(value);
+            // !(a < b) && !(b < a) <=> a == b
+            return element != nullptr && !lessThan(value, *element) ? element : nullptr;
+        }
+
+        template<class U>
+        T* findFirstGreaterOrEqual(const U& value) const
+        {
+            auto lessThan = detail::Comparator<T, LessThan, Project>{};
+            auto links    = head.data();
+            for (auto level = Levels; level-- > 0;) {
+                while (links[level] != nullptr && lessThan(*links[level], value)) {
+                    links = NG{}(links[level]).next.data();
+                }
+            }
+
+            return links[0];
+        }
+
+        template<class U>
+        T* findLastSmallerOrEqual(const U& value) const
+        {
+            auto lessThan = detail::Comparator<T, LessThan, Project>{};
+            auto links    = head.data();
+            auto result   = static_cast<T*>(nullptr);
+            for (auto level = Levels; level-- > 0;) {
+                // a <= b <--> !(b < a)
+                while (links[level] != nullptr && !lessThan(value, *links[level])) {
+                    result = links[level];
+                    links  = NG{}(result).next.data();
+                }
+            }
+
+            return result;
+        }
+
+        // Unlinks all elements and passes each to dispose.
+        template<class Dispose>
+        void clear(Dispose&& dispose)
+        {
+            auto element = head[0];
+            head.fill(nullptr);
+            while (element != nullptr) {
+                auto next = NG{}(element).next[0];
+                std::invoke(dispose, *element);
+                element = next;
+            }
+        }
+
+        static T* next(T& element) { return NG{}(element).next[0]; }
+
+        T* front() const { return head[0]; }
+
+        bool empty() const { return head[0] == nullptr; }
+
+        Iterator begin() const { return Iterator(head[0]); }
+
+        Iterator end() const { return Iterator(); }
+
+    private:
+        // Total order: by key, then by address.
+        static bool before(const T& a, const T& b)
+        {
+            auto lessThan = detail::Comparator<T, LessThan, Project>{};
+            return lessThan(a, b) || (!lessThan(b, a) && std::less<const T*>{}(&a, &b));
+        }
+
+        std::array<T*, Levels>             head{};
+        [[no_unique_address]] HeightPolicy heightPolicy;
+    };
+
+    // Helper template alias to facilitate the use of InlineSkipList with a member node.
+    template<class T, InlineSkipListNode<T> T::*Node, class Project = std::identity>
+    using InlineSkipListWithNodeMember = InlineSkipList<T, NodeFromMember<T, InlineSkipListNode, Node>, Project>;
+
+} // namespace rlib::intrusive
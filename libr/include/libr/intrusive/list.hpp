@@ -149,6 +149,8 @@ namespace rlib::intrusive {
 
         void pushFront(T& element) { link(*head, element, *head, NG{}); }
 
+        void pushBack(T& element) { link(*head, element, *head->prev, NG{}); }
+
         T* popFront()
         {
             auto element = head->next;
@@ -162,9 +164,9 @@ namespace rlib::intrusive {
 
         void remove(T& element) { unlink(*head, element, NG{}); }
 
-        ListIterator<T, NG> begin() { return {*head}; }
+        ListIterator<T, NG> begin() { return ListIterator<T, NG>(*head); }
 
-        ListIterator<T, NG> end() { return {head->prev}; }
+        ListIterator<T, NG> end() { return ListIterator<T, NG>(head->prev); }
 
         bool empty() const { return head->next == nullptr; }
 
@@ -24,16 +24,6 @@ namespace rlib::intrusive {
         }
     };
 
-    template<class T, class M, M T::*Member>
-    struct ProjectMember {
-        M operator()(const T& value) const { return value.*Member; }
-    };
-
-    template<class T, class M, M (T::*MemberFunc)() const>
-    struct ProjectMemberFunc {
-        M operator()(const T& value) const { return (value.*MemberFunc)(); }
-    };
-
     template<
         class T,
         NodeGetter<T, SkipListNode> NG = NodeFromBase<T, SkipListNode>,
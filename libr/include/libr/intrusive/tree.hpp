@@ -0,0 +1,368 @@
+#pragma once
+
+#include "common.hpp"
+#include "detail/comparator.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <utility>
+
+namespace rlib::intrusive {
+
+    template<class T>
+    struct TreeNode {
+        TreeNode() = default;
+
+        TreeNode(const TreeNode&) = delete;
+
+        TreeNode& operator=(const TreeNode&) = delete;
+
+        T*           parent = nullptr;
+        T*           left   = nullptr;
+        T*           right  = nullptr;
+        std::int32_t height = 1;
+    };
+
+    // Augmentation which keeps nothing.
+    struct NoAugmentation {
+        template<class T>
+        void operator()(T&, const T*, const T*) const
+        {}
+    };
+
+    template<typename T, NodeGetter<T, TreeNode> NG>
+    class TreeIterator {
+    public:
+        using value_type      = T;
+        using difference_type = std::ptrdiff_t;
+
+        TreeIterator() = default;
+
+        explicit TreeIterator(T* element) : element(element) {}
+
+        T* operator->() const { return element; }
+
+        T& operator*() const { return *element; }
+
+        TreeIterator& operator++()
+        {
+            element = successor(*element);
+            return *this;
+        }
+
+        TreeIterator operator++(int)
+        {
+            auto current = *this;
+            element      = successor(*element);
+            return current;
+        }
+
+        bool operator==(const TreeIterator& other) const { return element == other.element; }
+
+        static T* successor(T& element)
+        {
+            auto& node = NG{}(element);
+            if (node.right != nullptr) {
+                auto next = node.right;
+                while (NG{}(next).left != nullptr) {
+                    next = NG{}(next).left;
+                }
+                return next;
+            }
+
+            auto child  = &element;
+            auto parent = node.parent;
+            while (parent != nullptr && NG{}(parent).right == child) {
+                child  = parent;
+                parent = NG{}(parent).parent;
+            }
+            return parent;
+        }
+
+    private:
+        T* element = nullptr;
+    };
+
+    /**
+     * Intrusive AVL tree.
+     *
+     * The tree needs no head, so unlike List and SkipList it cannot fail to construct. Every node may be augmented
+     * with a summary of its subtree, such as the largest key below it: the Augment function is called on an element
+     * with its children whenever its subtree changes, bottom-up. Elements with equal keys are kept in insertion order.
+     */
+    template<
+        class T,
+        NodeGetter<T, TreeNode> NG = NodeFromBase<T, TreeNode>,
+        class Project              = std::identity,
+        class LessThan             = std::less<detail::Projected<T, Project>>,
+        class Augment              = NoAugmentation>
+    class Tree {
+    public:
+        using Iterator = TreeIterator<T, NG>;
+
+        static_assert(std::forward_iterator<Iterator>);
+
+        Tree() = default;
+
+        Tree(Tree&& other) : _root(std::exchange(other._root, nullptr)) {}
+
+        Tree& operator=(Tree&& other)
+        {
+            _root = std::exchange(other._root, nullptr);
+            return *this;
+        }
+
+        Tree(const Tree&) = delete;
+
+        Tree& operator=(const Tree&) = delete;
+
+        void insert(T& value)
+        {
+            auto& node  = NG{}(value);
+            node.left   = nullptr;
+            node.right  = nullptr;
+            node.height = 1;
+
+            auto lessThan = detail::Comparator<T, LessThan, Project>{};
+            auto parent   = static_cast<T*>(nullptr);
+            auto child    = &_root;
+            while (*child != nullptr) {
+                parent = *child;
+                child  = lessThan(value, *parent) ? &NG{}(parent).left : &NG{}(parent).right;
+            }
+            node.parent = parent;
+            *child      = &value;
+
+            rebalance(&value);
+        }
+
+        void remove(T& value)
+        {
+            auto& node = NG{}(value);
+            auto  from = node.parent;
+            if (node.left == nullptr || node.right == nullptr) {
+                auto child = node.left != nullptr ? node.left : node.right;
+                if (child != nullptr) {
+                    NG{}(child).parent = node.parent;
+                }
+                replaceChild(node.parent, value, child);
+            } else {
+                // Replace the element with its successor, which has no left child.
+                auto  successor     = leftmost(node.right);
+                auto& successorNode = NG{}(successor);
+                if (successorNode.parent != &value) {
+                    from            = successorNode.parent;
+                    NG{}(from).left = successorNode.right;
+                    if (successorNode.right != nullptr) {
+                        NG{}(successorNode.right).parent = from;
+                    }
+                    successorNode.right     = node.right;
+                    NG{}(node.right).parent = successor;
+                } else {
+                    from = successor;
+                }
+                successorNode.left     = node.left;
+                NG{}(node.left).parent = successor;
+                successorNode.parent   = node.parent;
+                replaceChild(node.parent, value, successor);
+            }
+
+            node.parent = nullptr;
+            node.left   = nullptr;
+            node.right  = nullptr;
+            node.height = 1;
+            rebalance(from);
+        }
+
+        // Recomputes the augmentation of value and its ancestors, after value changed without moving in the order.
+        void propagate(T& value) { rebalance(&value); }
+
+        // Unlinks all elements and passes each to dispose, children before their parent.
+        template<class Dispose>
+        void clear(Dispose&& dispose)
+        {
+            auto element = _root;
+            _root        = nullptr;
+            while (element != nullptr) {
+                auto& node = NG{}(element);
+                if (node.left != nullptr) {
+                    element = std::exchange(node.left, nullptr);
+                } else if (node.right != nullptr) {
+                    element = std::exchange(node.right, nullptr);
+                } else {
+                    auto parent = node.parent;
+                    std::invoke(dispose, *element);
+                    element = parent;
+                }
+            }
+        }
+
+        template<class U>
+        T* find(const U& value) const
+        {
+            auto lessThan = detail::Comparator<T, LessThan, Project>{};
+            auto element  = findFirstGreaterOrEqual(value);
+            // !(a < b) && !(b < a) <=> a == b
+            return element != nullptr && !lessThan(value, *element) ? element : nullptr;
+        }
+
+        template<class U>
+        T* findFirstGreaterOrEqual(const U& value) const
+        {
+            auto lessThan = detail::Comparator<T, LessThan, Project>{};
+            auto result   = static_cast<T*>(nullptr);
+            for (auto element = _root; element != nullptr;) {
+                if (lessThan(*element, value)) {
+                    element = NG{}(element).right;
+                } else {
+                    result  = element;
+                    element = NG{}(element).left;
+                }
+            }
+            return result;
+        }
+
+        template<class U>
+        T* findLastSmallerOrEqual(const U& value) const
+        {
+            auto lessThan = detail::Comparator<T, LessThan, Project>{};
+            auto result   = static_cast<T*>(nullptr);
+            for (auto element = _root; element != nullptr;) {
+                // a <= b <--> !(b < a)
+                if (lessThan(value, *element)) {
+                    element = NG{}(element).left;
+                } else {
+                    result  = element;
+                    element = NG{}(element).right;
+                }
+            }
+            return result;
+        }
+
+        // Accessors for searches guided by the augmentation.
+        T* root() const { return _root; }
+
+        static T* parent(T& element) { return NG{}(element).parent; }
+
+        static T* left(T& element) { return NG{}(element).left; }
+
+        static T* right(T& element) { return NG{}(element).right; }
+
+        static T* next(T& element) { return Iterator::successor(element); }
+
+        T* front() const { return _root != nullptr ? leftmost(_root) : nullptr; }
+
+        bool empty() const { return _root == nullptr; }
+
+        Iterator begin() const { return Iterator(front()); }
+
+        Iterator end() const { return Iterator(); }
+
+    private:
+        static T* leftmost(T* element)
+        {
+            while (NG{}(element).left != nullptr) {
+                element = NG{}(element).left;
+            }
+            return element;
+        }
+
+        static std::int32_t height(T* element) { return element != nullptr ? NG{}(element).height : 0; }
+
+        static void fix(T& element)
+        {
+            auto& node  = NG{}(element);
+            node.height = 1 + std::max(height(node.left), height(node.right));
+            Augment{}(element, static_cast<const T*>(node.left), static_cast<const T*>(node.right));
+        }
+
+        void replaceChild(T* parent, T& oldChild, T* newChild)
+        {
+            if (parent == nullptr) {
+                _root = newChild;
+            } else if (NG{}(parent).left == &oldChild) {
+                NG{}(parent).left = newChild;
+            } else {
+                NG{}(parent).right = newChild;
+            }
+        }
+
+        // Rotates the right child of element into its place, and returns it.
+        T* rotateLeft(T& element)
+        {
+            auto& node      = NG{}(element);
+            auto  pivot     = node.right;
+            auto& pivotNode = NG{}(pivot);
+
+            node.right = pivotNode.left;
+            if (pivotNode.left != nullptr) {
+                NG{}(pivotNode.left).parent = &element;
+            }
+            pivotNode.parent = node.parent;
+            replaceChild(node.parent, element, pivot);
+            pivotNode.left = &element;
+            node.parent    = pivot;
+
+            fix(element);
+            fix(*pivot);
+            return pivot;
+        }
+
+        // Rotates the left child of element into its place, and returns it.
+        T* rotateRight(T& element)
+        {
+            auto& node      = NG{}(element);
+            auto  pivot     = node.left;
+            auto& pivotNode = NG{}(pivot);
+
+            node.left = pivotNode.right;
+            if (pivotNode.right != nullptr) {
+                NG{}(pivotNode.right).parent = &element;
+            }
+            pivotNode.parent = node.parent;
+            replaceChild(node.parent, element, pivot);
+            pivotNode.right = &element;
+            node.parent     = pivot;
+
+            fix(element);
+            fix(*pivot);
+            return pivot;
+        }
+
+        // Restores heights, balance and augmentation from element up to the root.
+        void rebalance(T* element)
+        {
+            while (element != nullptr) {
+                fix(*element);
+
+                auto& node    = NG{}(element);
+                auto  balance = height(node.left) - height(node.right);
+                if (balance > 1) {
+                    auto& leftNode = NG{}(node.left);
+                    if (height(leftNode.left) < height(leftNode.right)) {
+                        rotateLeft(*node.left);
+                    }
+                    element = rotateRight(*element);
+                } else if (balance < -1) {
+                    auto& rightNode = NG{}(node.right);
+                    if (height(rightNode.right) < height(rightNode.left)) {
+                        rotateRight(*node.right);
+                    }
+                    element = rotateLeft(*element);
+                }
+
+                element = NG{}(element).parent;
+            }
+        }
+
+        T* _root = nullptr;
+    };
+
+    // Helper template alias to facilitate the use of Tree with a member node.
+    template<class T, TreeNode<T> T::*Node, class Project = std::identity, class Augment = NoAugmentation>
+    using TreeWithNodeMember =
+        Tree<T, NodeFromMember<T, TreeNode, Node>, Project, std::less<detail::Projected<T, Project>>, Augment>;
+
+} // namespace rlib::intrusive
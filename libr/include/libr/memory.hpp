@@ -3,3 +3,5 @@
 #include <cstddef>
 
 void* memcpy(void* dest, const void* src, std::size_t count);
+
+void* memset(void* dest, int value, std::size_t count);
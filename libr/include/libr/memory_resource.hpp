@@ -1,7 +1,14 @@
 #pragma once
 
-#include "intrusive/skiplist.hpp"
+#include "intrusive/inlineskiplist.hpp"
+#include "intrusive/tree.hpp"
+#include <libr/allocator.hpp>
+#include <libr/error.hpp>
+#include <libr/pointer.hpp>
+#include <expected>
+#include <optional>
 #include <cstdint>
+#include <algorithm>
 
 namespace rlib {
 
@@ -11,57 +18,263 @@ namespace rlib {
     inline constexpr auto OutOfResource = Error{-1, &resourceErrorCategory};
     inline constexpr auto DoesNotFit    = Error{-2, &resourceErrorCategory};
 
+    // Whether size bytes starting at a multiple of alignment fit in the block. Alignment is a power of two.
+    template<class Block>
+    bool fitsAligned(const Block& block, std::size_t size, std::size_t alignment)
+    {
+        auto start = (block.startAddress + alignment - 1) & ~(alignment - 1);
+        return start >= block.startAddress && start - block.startAddress + size <= block.size;
+    }
+
 
     struct OrderedBlock {
         std::uintptr_t startAddress = 0;
         std::size_t    size         = 0;
 
-        intrusive::SkipListNode<OrderedBlock> addressNode;
-        intrusive::SkipListNode<OrderedBlock> sizeNode;
+        intrusive::InlineSkipListNode<OrderedBlock> addressNode;
+        intrusive::InlineSkipListNode<OrderedBlock> sizeNode;
+    };
+
+    // Free blocks in two skip lists, one by address and one by size, for best fit allocation.
+    class SkipListIndex {
+    public:
+        using Block = OrderedBlock;
+
+        std::optional<Error> insert(Block& block)
+        {
+            blocksByAddress.insert(block);
+            blocksBySize.insert(block);
+            return {};
+        }
+
+        void remove(Block& block)
+        {
+            blocksByAddress.remove(block);
+            blocksBySize.remove(block);
+        }
+
+        // The update must keep the block between its neighbours, which holds as free blocks do not overlap. Only
+        // the size order has to be restored.
+        template<class UpdateFunc>
+        std::optional<Error> update(Block& block, UpdateFunc&& update)
+        {
+            blocksBySize.remove(block);
+            std::invoke(std::forward<UpdateFunc>(update), block);
+            blocksBySize.insert(block);
+            return {};
+        }
+
+        // Smallest block which fits size bytes at a multiple of alignment.
+        Block* findFit(std::size_t size, std::size_t alignment) const
+        {
+            auto block = blocksBySize.findFirstGreaterOrEqual(size);
+            while (block != nullptr && !fitsAligned(*block, size, alignment)) {
+                block = BlocksBySize::next(*block);
+            }
+            return block;
+        }
+
+        // Block with the highest start address at or below address.
+        Block* findLastAtOrBefore(std::uintptr_t address) const
+        {
+            return blocksByAddress.findLastSmallerOrEqual(address);
+        }
+
+        // Block following block by address, or the first block if block is null.
+        Block* next(Block* block) const
+        {
+            return block == nullptr ? blocksByAddress.front() : BlocksByAddress::next(*block);
+        }
+
+        template<IsAllocator Alloc>
+        void clear(Alloc& blockAllocator)
+        {
+            blocksBySize.clear([](Block&) {});
+            blocksByAddress.clear([&](Block& block) { destruct(&block, blockAllocator); });
+        }
+
+    private:
+        using BlocksByAddress = intrusive::InlineSkipListWithNodeMember<
+            OrderedBlock,
+            &OrderedBlock::addressNode,
+            intrusive::ProjectMember<OrderedBlock, std::uintptr_t, &OrderedBlock::startAddress>>;
+        using BlocksBySize = intrusive::InlineSkipListWithNodeMember<
+            OrderedBlock,
+            &OrderedBlock::sizeNode,
+            intrusive::ProjectMember<OrderedBlock, std::size_t, &OrderedBlock::size>>;
+
+        BlocksByAddress blocksByAddress;
+        BlocksBySize    blocksBySize;
+    };
+
+
+    struct AugmentedBlock {
+        std::uintptr_t startAddress = 0;
+        std::size_t    size         = 0;
+        // Size of the largest block in the subtree of this block.
+        std::size_t maxSize = 0;
+
+        intrusive::TreeNode<AugmentedBlock> node;
     };
 
-    class MemoryResource {
+    /**
+     * Free blocks in a single tree by address, where every block knows the largest size in its subtree.
+     *
+     * Allocation takes the lowest addressed block which fits, found in O(log n) by descending into the leftmost
+     * subtree which is large enough. Address ordered first fit keeps fragmentation on par with best fit. Nodes live
+     * in the blocks, so the index never allocates.
+     */
+    class TreeIndex {
     public:
-        static std::expected<MemoryResource, Error> make(
-            std::uintptr_t startAddress,
-            std::size_t    size,
-            std::size_t    layers,
-            Allocator&     blockAllocator,
-            Allocator&     skipNodeAllocator,
-            Allocator&     listNodeAllocator
-        );
+        using Block = AugmentedBlock;
+
+        std::optional<Error> insert(Block& block)
+        {
+            blocks.insert(block);
+            return {};
+        }
+
+        void remove(Block& block) { blocks.remove(block); }
 
-        MemoryResource(MemoryResource&& other);
+        // The update must keep the block between its neighbours, which holds as free blocks do not overlap.
+        template<class UpdateFunc>
+        std::optional<Error> update(Block& block, UpdateFunc&& update)
+        {
+            std::invoke(std::forward<UpdateFunc>(update), block);
+            blocks.propagate(block);
+            return {};
+        }
 
-        MemoryResource(const MemoryResource&) = delete;
+        // Lowest addressed block which fits size bytes at a multiple of alignment. Blocks which are large enough
+        // but misaligned are skipped one by one, each in O(log n).
+        Block* findFit(std::size_t size, std::size_t alignment) const
+        {
+            auto block = firstFit(blocks.root(), size);
+            while (block != nullptr && !fitsAligned(*block, size, alignment)) {
+                block = nextFit(*block, size);
+            }
+            return block;
+        }
 
-        MemoryResource& operator=(const MemoryResource&) = delete;
+        // Block with the highest start address at or below address.
+        Block* findLastAtOrBefore(std::uintptr_t address) const { return blocks.findLastSmallerOrEqual(address); }
+
+        // Block following block by address, or the first block if block is null.
+        Block* next(Block* block) const { return block == nullptr ? blocks.front() : Blocks::next(*block); }
+
+        template<IsAllocator Alloc>
+        void clear(Alloc& blockAllocator)
+        {
+            blocks.clear([&](Block& block) { destruct(&block, blockAllocator); });
+        }
+
+    private:
+        // Lowest addressed block of at least size bytes in the subtree of block.
+        static Block* firstFit(Block* block, std::size_t size)
+        {
+            if (block == nullptr || block->maxSize < size) {
+                return nullptr;
+            }
+
+            while (true) {
+                auto left = Blocks::left(*block);
+                if (left != nullptr && left->maxSize >= size) {
+                    block = left;
+                } else if (block->size >= size) {
+                    return block;
+                } else {
+                    block = Blocks::right(*block);
+                }
+            }
+        }
+
+        // Block of at least size bytes following block by address.
+        static Block* nextFit(Block& block, std::size_t size)
+        {
+            if (auto fit = firstFit(Blocks::right(block), size); fit != nullptr) {
+                return fit;
+            }
+
+            // Climb until arriving from a left subtree; the parent and its right subtree follow it.
+            auto child  = &block;
+            auto parent = Blocks::parent(block);
+            while (parent != nullptr) {
+                if (Blocks::left(*parent) == child) {
+                    if (parent->size >= size) {
+                        return parent;
+                    }
+                    if (auto fit = firstFit(Blocks::right(*parent), size); fit != nullptr) {
+                        return fit;
+                    }
+                }
+                child  = parent;
+                parent = Blocks::parent(*parent);
+            }
+
+            return nullptr;
+        }
+
+        struct MaxSize {
+            void operator()(Block& block, const Block* left, const Block* right) const
+            {
+                block.maxSize = std::max(
+                    {block.size, left != nullptr ? left->maxSize : 0, right != nullptr ? right->maxSize : 0}
+                );
+            }
+        };
+
+        using Blocks = intrusive::TreeWithNodeMember<
+            AugmentedBlock,
+            &AugmentedBlock::node,
+            intrusive::ProjectMember<AugmentedBlock, std::uintptr_t, &AugmentedBlock::startAddress>,
+            MaxSize>;
+
+        Blocks blocks;
+    };
+
+
+    // Allocates ranges of addresses, keeping the free ranges as blocks in an Index.
+    template<class Index>
+    class BasicMemoryResource {
+    public:
+        using Block = typename Index::Block;
+
+        static std::expected<BasicMemoryResource, Error>
+        make(std::uintptr_t startAddress, std::size_t size, Allocator& blockAllocator, Index index);
+
+        BasicMemoryResource(BasicMemoryResource&& other);
+
+        BasicMemoryResource(const BasicMemoryResource&) = delete;
+
+        BasicMemoryResource& operator=(const BasicMemoryResource&) = delete;
 
         std::expected<std::uintptr_t, Error> allocate(std::size_t size);
 
+        // Allocates size bytes at a multiple of alignment, which is a power of two. The remainders on either side
+        // of the allocation stay free.
+        std::expected<std::uintptr_t, Error> allocateAligned(std::size_t size, std::size_t alignment);
+
         std::expected<std::uintptr_t, Error> allocate(std::uintptr_t startAddress, std::size_t size);
 
         std::optional<Error> deallocate(std::uintptr_t address, std::size_t size);
 
-        ~MemoryResource();
+        ~BasicMemoryResource();
 
     private:
-        using BlocksByAddress = intrusive::SkipList<
-            OrderedBlock,
-            intrusive::NodeFromMember<OrderedBlock, intrusive::SkipListNode, &OrderedBlock::addressNode>,
-            intrusive::ProjectMember<OrderedBlock, decltype(OrderedBlock::startAddress), &OrderedBlock::startAddress>>;
-        using BlocksBySize = intrusive::SkipList<
-            OrderedBlock,
-            intrusive::NodeFromMember<OrderedBlock, intrusive::SkipListNode, &OrderedBlock::sizeNode>,
-            intrusive::ProjectMember<OrderedBlock, decltype(OrderedBlock::size), &OrderedBlock::size>>;
+        BasicMemoryResource(Allocator& blockAllocator, Index index);
 
-        using Blocks = std::tuple<BlocksByAddress, BlocksBySize>;
+        std::expected<Block*, Error> emplace(std::uintptr_t startAddress, std::size_t size);
 
-        MemoryResource(Allocator& blockAllocator, Blocks blocks);
+        // Takes size bytes at startAddress out of block, which contains them.
+        std::optional<Error> carve(Block& block, std::uintptr_t startAddress, std::size_t size);
 
         Allocator* blockAllocator;
-        Blocks     blocks;
+        Index      index;
     };
 
+    extern template class BasicMemoryResource<SkipListIndex>;
+    extern template class BasicMemoryResource<TreeIndex>;
+
+    using MemoryResource = BasicMemoryResource<TreeIndex>;
 
 } // namespace rlib
@@ -15,6 +15,9 @@ namespace rlib {
 
         T* dequeueAll(T* dest);
 
+        // Whether there is nothing to dequeue. Only meaningful to the consumer.
+        bool empty() const;
+
     private:
         static std::size_t next(std::size_t current);
 
@@ -34,6 +37,9 @@ namespace rlib {
 
         std::optional<T> dequeue();
 
+        // Whether there is nothing to dequeue, as a hint while other threads enqueue or dequeue.
+        bool empty() const;
+
     private:
         struct Cell {
             std::atomic<std::size_t> sequence;
@@ -74,6 +80,12 @@ namespace rlib {
         return dest;
     }
 
+    template<typename T, std::size_t Size>
+    bool spscBoundedQueue<T, Size>::empty() const
+    {
+        return tail.load(std::memory_order_relaxed) == head.load(std::memory_order_acquire);
+    }
+
     template<typename T, std::size_t Size>
     std::size_t spscBoundedQueue<T, Size>::next(std::size_t current)
     {
@@ -163,4 +175,12 @@ namespace rlib {
         return data;
     }
 
+    template<class T>
+    bool mpmcBoundedQueue<T>::empty() const
+    {
+        // The cell at the dequeue position holds data once its sequence is one past the position.
+        auto pos = dequeuePos.load(std::memory_order_relaxed);
+        return buffer[pos & bufferMask].sequence.load(std::memory_order_acquire) != pos + 1;
+    }
+
 }; // namespace rlib
@@ -0,0 +1,178 @@
+#pragma once
+
+#include "allocator.hpp"
+#include "error.hpp"
+#include "intrusive/list.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <expected>
+#include <optional>
+#include <utility>
+
+namespace rlib {
+
+    /**
+     * General purpose allocator with segregated size classes, in the spirit of mimalloc.
+     *
+     * Small blocks are carved from pages of PageSize bytes, taken from the upstream allocator aligned to PageSize. A
+     * page serves a single size class and starts with a header, so blocks carry no header of their own: the page of a
+     * block is found by masking its address. Free blocks are linked through their storage, and the pages of a size
+     * class which have free blocks are kept in a list. Pages are returned upstream once they are empty, except the
+     * last page of a size class.
+     *
+     * Size classes are spaced 16 bytes apart up to 128 bytes, and four per power of two above that, which bounds
+     * internal fragmentation to 25%. Blocks larger than MaxSmallSize, or with an alignment above MinAlignment, go
+     * straight to the upstream allocator. Deallocation relies on the size passed in to tell the two apart.
+     */
+    template<IsAllocator Upstream>
+    class SizeClassAllocator : public Allocator {
+    public:
+        static constexpr auto PageSize     = std::size_t(64 * 1024);
+        static constexpr auto MinAlignment = std::size_t(16);
+        static constexpr auto MaxSmallSize = std::size_t(8 * 1024);
+
+        static std::expected<SizeClassAllocator, Error> make(Upstream upstream, Allocator& allocator)
+        {
+            auto pages = [&]<std::size_t... Classes>(std::index_sequence<Classes...>) -> std::optional<Pages> {
+                auto lists = std::array{((void)Classes, PageList::make(allocator))...};
+                if (std::ranges::any_of(lists, [](const auto& list) { return !list; })) {
+                    return {};
+                }
+                return Pages{std::move(*lists[Classes])...};
+            }(std::make_index_sequence<SizeClasses>{});
+            if (!pages) {
+                return std::unexpected(OutOfMemoryError);
+            }
+
+            return SizeClassAllocator(std::move(upstream), std::move(*pages));
+        }
+
+    private:
+        struct FreeBlock {
+            FreeBlock* next;
+        };
+
+        struct alignas(MinAlignment) Page {
+            intrusive::ListNode<Page> node;
+            FreeBlock*                freeBlocks;
+            std::uint32_t             usedBlocks;
+            std::uint8_t              sizeClass;
+        };
+
+        static constexpr auto LinearClasses = std::size_t(8);
+        static constexpr auto SizeClasses =
+            LinearClasses + 4 * std::size_t(std::countr_zero(MaxSmallSize) - std::countr_zero(LinearClasses * 16));
+
+        using PageList = intrusive::ListWithNodeMember<Page, &Page::node>;
+        // Per size class, the pages which have free blocks. Full pages are not tracked.
+        using Pages = std::array<PageList, SizeClasses>;
+
+        SizeClassAllocator(Upstream upstream, Pages pages) : upstream(std::move(upstream)), pages(std::move(pages)) {}
+
+        static bool isSmall(std::size_t bytes, std::size_t alignment)
+        {
+            return bytes <= MaxSmallSize && alignment <= MinAlignment;
+        }
+
+        static std::size_t sizeClass(std::size_t bytes)
+        {
+            auto size = std::max<std::size_t>(bytes, 1);
+            if (size <= LinearClasses * 16) {
+                return (size - 1) / 16;
+            }
+
+            // size lies in (2^(width - 1), 2^width], which is split into four steps.
+            auto width = std::size_t(std::bit_width(size - 1));
+            auto step  = ((size - 1) >> (width - 3)) - 4;
+            return LinearClasses + 4 * (width - 8) + step;
+        }
+
+        static std::size_t blockSize(std::size_t sizeClass)
+        {
+            if (sizeClass < LinearClasses) {
+                return (sizeClass + 1) * 16;
+            }
+
+            auto base = (LinearClasses * 16) << ((sizeClass - LinearClasses) / 4);
+            return base + ((sizeClass - LinearClasses) % 4 + 1) * (base / 4);
+        }
+
+        static Page& pageOf(void* block)
+        {
+            return *reinterpret_cast<Page*>(reinterpret_cast<std::uintptr_t>(block) & ~(PageSize - 1));
+        }
+
+        Page* grow(std::size_t sizeClass)
+        {
+            auto storage = static_cast<std::byte*>(upstream.allocate(PageSize, PageSize));
+            if (storage == nullptr) {
+                return nullptr;
+            }
+
+            auto page = ::new (storage) Page{{}, nullptr, 0, static_cast<std::uint8_t>(sizeClass)};
+            auto size = blockSize(sizeClass);
+            for (auto i = (PageSize - sizeof(Page)) / size; i-- > 0;) {
+                page->freeBlocks = ::new (storage + sizeof(Page) + i * size) FreeBlock{page->freeBlocks};
+            }
+
+            pages[sizeClass].pushFront(*page);
+            return page;
+        }
+
+        virtual void* do_allocate(std::size_t bytes, std::size_t alignment) final
+        {
+            if (!isSmall(bytes, alignment)) {
+                return upstream.allocate(bytes, alignment);
+            }
+
+            auto sizeClass = this->sizeClass(bytes);
+            auto page      = pages[sizeClass].front();
+            if (page == nullptr) {
+                page = grow(sizeClass);
+                if (page == nullptr) {
+                    return nullptr;
+                }
+            }
+
+            auto block       = page->freeBlocks;
+            page->freeBlocks = block->next;
+            page->usedBlocks++;
+            if (page->freeBlocks == nullptr) {
+                pages[sizeClass].remove(*page);
+            }
+
+            return block;
+        }
+
+        virtual void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) final
+        {
+            if (!isSmall(bytes, alignment)) {
+                upstream.deallocate(p, bytes, alignment);
+                return;
+            }
+
+            auto& page = pageOf(p);
+            auto& list = pages[page.sizeClass];
+            if (page.freeBlocks == nullptr) {
+                list.pushFront(page);
+            }
+            page.freeBlocks = ::new (p) FreeBlock{page.freeBlocks};
+            page.usedBlocks--;
+
+            // Keep the last page of a size class, so that alternating allocations and frees do not go upstream.
+            auto lastPage = list.front() == &page && page.node.next == nullptr;
+            if (page.usedBlocks == 0 && !lastPage) {
+                list.remove(page);
+                upstream.deallocate(&page, PageSize, PageSize);
+            }
+        }
+
+        virtual bool do_owns(void* p) const final { return upstream.owns(p); }
+
+        Upstream upstream;
+        Pages    pages;
+    };
+
+} // namespace rlib
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+
+namespace rlib {
+
+    /**
+     * Test-and-test-and-set lock for short critical sections shared between processors.
+     *
+     * Waiters spin on a plain load, so that the cache line of the lock stays shared until it is released. The lock is
+     * not recursive and leaves interrupts alone: it must not be taken by code which can interrupt a holder on the same
+     * processor.
+     */
+    class SpinLock {
+    public:
+        SpinLock() = default;
+
+        SpinLock(const SpinLock&) = delete;
+
+        SpinLock& operator=(const SpinLock&) = delete;
+
+        void lock()
+        {
+            while (locked.exchange(true, std::memory_order_acquire)) {
+                while (locked.load(std::memory_order_relaxed)) {
+                    __builtin_ia32_pause();
+                }
+            }
+        }
+
+        bool tryLock()
+        {
+            return !locked.load(std::memory_order_relaxed) && !locked.exchange(true, std::memory_order_acquire);
+        }
+
+        void unlock() { locked.store(false, std::memory_order_release); }
+
+    private:
+        std::atomic<bool> locked = false;
+    };
+
+    // Tag for a LockGuard of a lock which the caller holds already.
+    struct AdoptLock {};
+
+    inline constexpr auto adoptLock = AdoptLock{};
+
+    // Holds a lock for as long as the guard lives.
+    template<class Lock>
+    class LockGuard {
+    public:
+        explicit LockGuard(Lock& lock) : _lock(lock) { _lock.lock(); }
+
+        LockGuard(Lock& lock, AdoptLock) : _lock(lock) {}
+
+        LockGuard(const LockGuard&) = delete;
+
+        LockGuard& operator=(const LockGuard&) = delete;
+
+        ~LockGuard() { _lock.unlock(); }
+
+    private:
+        Lock& _lock;
+    };
+
+} // namespace rlib
@@ -33,6 +33,9 @@ namespace rlib {
 
         MemorySource slice(std::size_t start, std::size_t size) const;
 
+        // Address of the first byte of the source.
+        std::byte* pointer() const;
+
     private:
         std::byte*  data;
         std::size_t size;
@@ -65,6 +68,8 @@ namespace rlib {
         InputStream slice(std::size_t start, std::size_t size) const
         requires IsSlicable<Source>;
 
+        const Source& buffer() const;
+
     private:
         Source               source;
         std::size_t          pos;
@@ -142,6 +147,11 @@ namespace rlib {
         return MemorySource(this->data + start, size);
     }
 
+    inline std::byte* MemorySource::pointer() const
+    {
+        return data;
+    }
+
     template<class Source>
     InputStream<Source>::InputStream(Source buffer) : source(std::move(buffer))
     {}
@@ -188,6 +198,12 @@ namespace rlib {
         return InputStream(sliced);
     }
 
+    template<class Source>
+    const Source& InputStream<Source>::buffer() const
+    {
+        return source;
+    }
+
     template<class Source>
     template<IsStreamReadable T>
     T InputStream<Source>::read()
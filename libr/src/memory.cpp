@@ -11,3 +11,14 @@ void* memcpy(void* dest, const void* src, std::size_t count)
 
     return dest;
 }
+
+void* memset(void* dest, int value, std::size_t count)
+{
+    auto destBuffer = reinterpret_cast<std::byte*>(dest);
+
+    for (auto i = std::size_t(0); i < count; i++) {
+        destBuffer[i] = static_cast<std::byte>(value);
+    }
+
+    return dest;
+}
@@ -1,136 +1,159 @@
 #include <libr/memory_resource.hpp>
-#include <libr/intrusive/multiindex.hpp>
 
 using namespace rlib;
 
 
-std::expected<MemoryResource, Error> MemoryResource::make(
-    std::uintptr_t startAddress,
-    std::size_t    size,
-    std::size_t    layers,
-    Allocator&     blockAllocator,
-    Allocator&     skipNodeAllocator,
-    Allocator&     listNodeAllocator
+template<class Index>
+std::expected<BasicMemoryResource<Index>, Error> BasicMemoryResource<Index>::make(
+    std::uintptr_t startAddress, std::size_t size, Allocator& blockAllocator, Index index
 )
 {
-    auto blocksByAddress = BlocksByAddress::make(layers, skipNodeAllocator, listNodeAllocator);
-    if (!blocksByAddress) {
-        return std::unexpected(blocksByAddress.error());
-    }
-    auto blocksBySize = BlocksBySize::make(layers, skipNodeAllocator, listNodeAllocator);
-    if (!blocksBySize) {
-        return std::unexpected(blocksBySize.error());
-    }
-    auto blocks = Blocks{std::move(*blocksByAddress), std::move(*blocksBySize)};
-
-    auto block = intrusive::emplace<OrderedBlock>(blockAllocator, blocks, startAddress, size);
+    auto resource = BasicMemoryResource(blockAllocator, std::move(index));
+    auto block    = resource.emplace(startAddress, size);
     if (!block) {
         return std::unexpected(block.error());
     }
 
-    return MemoryResource(blockAllocator, std::move(blocks));
+    return resource;
 }
 
-MemoryResource::MemoryResource(Allocator& blockAllocator, Blocks blocks) :
-    blockAllocator(&blockAllocator), blocks(std::move(blocks))
+template<class Index>
+BasicMemoryResource<Index>::BasicMemoryResource(Allocator& blockAllocator, Index index) :
+    blockAllocator(&blockAllocator), index(std::move(index))
 {}
 
-MemoryResource::MemoryResource(MemoryResource&& other) :
-    blockAllocator(other.blockAllocator), blocks(std::move(other.blocks))
+template<class Index>
+BasicMemoryResource<Index>::BasicMemoryResource(BasicMemoryResource&& other) :
+    blockAllocator(other.blockAllocator), index(std::move(other.index))
 {
     other.blockAllocator = nullptr;
 }
 
-std::expected<std::uintptr_t, Error> MemoryResource::allocate(std::size_t size)
+template<class Index>
+std::expected<typename BasicMemoryResource<Index>::Block*, Error>
+BasicMemoryResource<Index>::emplace(std::uintptr_t startAddress, std::size_t size)
 {
-    auto& blocksBySize = std::get<BlocksBySize>(blocks);
-    auto  block        = blocksBySize.findFirstGreaterOrEqual(size);
-    if (block == blocksBySize.end()) {
+    auto block = construct<Block>(*blockAllocator);
+    if (block == nullptr) {
+        return std::unexpected(OutOfMemoryError);
+    }
+    block->startAddress = startAddress;
+    block->size         = size;
+
+    auto error = index.insert(*block);
+    if (error) {
+        return std::unexpected(*error);
+    }
+
+    return block.release();
+}
+
+template<class Index>
+std::expected<std::uintptr_t, Error> BasicMemoryResource<Index>::allocate(std::size_t size)
+{
+    return allocateAligned(size, 1);
+}
+
+template<class Index>
+std::expected<std::uintptr_t, Error> BasicMemoryResource<Index>::allocateAligned(std::size_t size, std::size_t alignment)
+{
+    auto block = index.findFit(size, alignment);
+    if (block == nullptr) {
         return std::unexpected(OutOfResource);
     }
 
-    auto address = block->startAddress;
-    if (block->size > size) {
-        auto error = update(*block, [&](auto& block) { block.startAddress += size, block.size -= size; }, blocks);
-        if (error) {
-            return std::unexpected(*error);
-        }
-    } else {
-        removeAndDestruct(*block, *blockAllocator, blocks);
+    auto address = (block->startAddress + alignment - 1) & ~(alignment - 1);
+    auto error   = carve(*block, address, size);
+    if (error) {
+        return std::unexpected(*error);
     }
 
     return address;
 }
 
-std::expected<std::uintptr_t, Error> MemoryResource::allocate(std::uintptr_t startAddress, std::size_t size)
+template<class Index>
+std::expected<std::uintptr_t, Error> BasicMemoryResource<Index>::allocate(std::uintptr_t startAddress, std::size_t size)
 {
-    auto& blocksByAddress = std::get<BlocksByAddress>(blocks);
-    auto  block           = blocksByAddress.findLastSmallerOrEqual(startAddress);
-    if (block == blocksByAddress.end()) {
+    auto block = index.findLastAtOrBefore(startAddress);
+    if (block == nullptr) {
         return std::unexpected(DoesNotFit);
     }
 
-    if (block->size - (startAddress - block->startAddress) < size) {
+    if (startAddress + size > block->startAddress + block->size) {
         return std::unexpected(DoesNotFit);
     }
 
-    auto rightSize = block->startAddress + block->size - startAddress - size;
-    if (block->startAddress < startAddress) {
+    auto error = carve(*block, startAddress, size);
+    if (error) {
+        return std::unexpected(*error);
+    }
+
+    return startAddress;
+}
+
+template<class Index>
+std::optional<Error> BasicMemoryResource<Index>::carve(Block& block, std::uintptr_t startAddress, std::size_t size)
+{
+    auto rightSize = block.startAddress + block.size - startAddress - size;
+    if (block.startAddress < startAddress) {
         // Update block to be the free block to the left of the allocated block
-        auto error = update(*block, [&](auto& block) { block.size = startAddress - block.startAddress; }, blocks);
+        auto error = index.update(block, [&](auto& block) { block.size = startAddress - block.startAddress; });
         if (error) {
-            return std::unexpected(*error);
+            return error;
         }
 
         if (rightSize > 0) {
             // Insert a new block to the right of the allocated block
-            auto rightBlock = emplace<OrderedBlock>(*blockAllocator, blocks, startAddress + size, rightSize);
+            auto rightBlock = emplace(startAddress + size, rightSize);
             if (!rightBlock) {
-                return std::unexpected(rightBlock.error());
+                return rightBlock.error();
             }
         }
     } else if (rightSize > 0) {
         // Update block to be the free block to the right of the allocated block
-        auto error = update(
-            *block, [&](auto& block) { block.startAddress = startAddress + size, block.size = rightSize; }, blocks
-        );
+        auto error = index.update(block, [&](auto& block) {
+            block.startAddress = startAddress + size, block.size = rightSize;
+        });
         if (error) {
-            return std::unexpected(*error);
+            return error;
         }
     } else { // Block is exactly the right size
-        removeAndDestruct(*block, *blockAllocator, blocks);
+        index.remove(block);
+        destruct(&block, *blockAllocator);
     }
 
-    return startAddress;
+    return {};
 }
 
-std::optional<Error> MemoryResource::deallocate(std::uintptr_t address, std::size_t size)
+template<class Index>
+std::optional<Error> BasicMemoryResource<Index>::deallocate(std::uintptr_t address, std::size_t size)
 {
-    auto& blocksByAddress = std::get<BlocksByAddress>(blocks);
-    auto  leftBlock       = blocksByAddress.findLastSmallerOrEqual(address);
-    auto  rightBlock      = leftBlock == blocksByAddress.end() ? blocksByAddress.begin() : std::next(leftBlock);
-    auto  hasLeftBlock    = leftBlock != blocksByAddress.end() && leftBlock->startAddress + leftBlock->size == address;
-    auto  hasRightBlock = rightBlock != blocksByAddress.end() && rightBlock->startAddress == address + rightBlock->size;
+    auto leftBlock     = index.findLastAtOrBefore(address);
+    auto rightBlock    = index.next(leftBlock);
+    auto hasLeftBlock  = leftBlock != nullptr && leftBlock->startAddress + leftBlock->size == address;
+    auto hasRightBlock = rightBlock != nullptr && rightBlock->startAddress == address + size;
 
     if (hasLeftBlock && hasRightBlock) {
-        auto error = update(*leftBlock, [&](auto& block) { block.size += size + rightBlock->size; }, blocks);
+        auto rightSize = rightBlock->size;
+        index.remove(*rightBlock);
+        destruct(rightBlock, *blockAllocator);
+
+        auto error = index.update(*leftBlock, [&](auto& block) { block.size += size + rightSize; });
         if (error) {
             return error;
         }
-
-        removeAndDestruct(*rightBlock, *blockAllocator, blocks);
     } else if (hasLeftBlock) {
-        auto error = update(*leftBlock, [&](auto& block) { block.size += size; }, blocks);
+        auto error = index.update(*leftBlock, [&](auto& block) { block.size += size; });
         if (error) {
             return error;
         }
     } else if (hasRightBlock) {
-        auto error = update(*rightBlock, [&](auto& block) { block.startAddress -= size, block.size += size; }, blocks);
+        auto error = index.update(*rightBlock, [&](auto& block) { block.startAddress -= size, block.size += size; });
         if (error) {
             return error;
         }
     } else {
-        auto block = emplace<OrderedBlock>(*blockAllocator, blocks, address, size);
+        auto block = emplace(address, size);
         if (!block) {
             return {block.error()};
         }
@@ -139,11 +162,15 @@ std::optional<Error> MemoryResource::deallocate(std::uintptr_t address, std::siz
     return {};
 }
 
-MemoryResource::~MemoryResource()
+template<class Index>
+BasicMemoryResource<Index>::~BasicMemoryResource()
 {
     if (blockAllocator == nullptr) {
         return;
     }
 
-    clear(blocks, *blockAllocator);
+    index.clear(*blockAllocator);
 }
+
+template class rlib::BasicMemoryResource<SkipListIndex>;
+template class rlib::BasicMemoryResource<TreeIndex>;
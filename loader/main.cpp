@@ -14,6 +14,7 @@
 #include <kernel/cpu.hpp>
 #include <kernel/panic.hpp>
 #include <concepts>
+#include <atomic>
 
 // BOOTBOOT imported virtual addresses, see see linker script
 extern BOOTBOOT      bootboot;
@@ -29,6 +30,9 @@ extern unsigned char __writable_data_end;
 // Initial heap
 alignas(std::max_align_t) std::byte initialHeap[Kernel::IntialHeapSize];
 
+// Published by the bootstrap processor once the kernel is created. BOOTBOOT starts all processors at main.
+std::atomic<Kernel*> bootedKernel = nullptr;
+
 FrameBufferInfo getFrameBufferInfo()
 {
     return {&fb, bootboot.fb_size, bootboot.fb_width, bootboot.fb_height, bootboot.fb_scanline};
@@ -84,19 +88,29 @@ std::expected<Kernel, rlib::Error> makeKernel()
         &fb,
         bootboot.fb_size,
         bootboot.initrd_ptr, // This equals the physical address because of the identity mapping provided by BOOTBOOT
-        bootboot.initrd_size
+        bootboot.initrd_size,
+        bootboot.arch.x86_64.acpi_ptr
     };
-    return Kernel::make(memoryLayout, initialHeap, tableLevel4);
+    return Kernel::make(memoryLayout, bootboot.numcores, initialHeap, tableLevel4);
 }
 
 int main()
 {
+    if (Cpu::localApicId() != bootboot.bspid) {
+        auto kernel = static_cast<Kernel*>(nullptr);
+        while ((kernel = bootedKernel.load(std::memory_order_acquire)) == nullptr) {
+            Cpu::pause();
+        }
+        kernel->startProcessor();
+    }
+
     initializePanicHandler(getFrameBufferInfo());
 
     auto kernel = makeKernel();
     if (!kernel) {
         panic("Cannot create kernel");
     }
+    bootedKernel.store(&*kernel, std::memory_order_release);
     kernel->run();
 
     return 0;